@@ -0,0 +1,123 @@
+//
+// Micro-benchmark of the pixel kernels in src/pixelops.cpp against the
+// code they replaced in filepair.cpp:
+//   paste  - memcpy per row (what FreeImage_Paste boils down to)
+//   border - the scalar border loop plus two memcpy calls
+//   clear  - allocating a zeroed block and pasting it, as deleteFile did
+//
+// The CMake build has it as the pixelops_bench target. Or build and run it
+// from this directory, for example:
+//   g++ -O2 -I../src pixelops_bench.cpp ../src/pixelops.cpp -o pixelops_bench
+//   cl /O2 /EHsc /I..\src pixelops_bench.cpp ..\src\pixelops.cpp
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include "pixelops.h"
+using namespace std;
+
+static const size_t ATLAS   = 2048;		// Atlas width and height
+static const int    REPEATS = 200;
+
+static double Now()
+{
+	return (double)clock() / CLOCKS_PER_SEC;
+}
+
+// The old code paths
+static void OldPaste(uint32_t* dst, ptrdiff_t dstPitch, const uint32_t* src, ptrdiff_t srcPitch, size_t w, size_t h)
+{
+	for (size_t y = 0; y < h; y++)
+	{
+		memcpy((char*)dst + y * dstPitch, (const char*)src + y * srcPitch, w * sizeof(uint32_t));
+	}
+}
+
+static void OldBorder(uint32_t* start, ptrdiff_t pitch, size_t w, size_t h)
+{
+	uint32_t* bits = start;
+	for (size_t y = 0; y < h; y++)
+	{
+		*(bits - 1) = *(bits + 0);
+		*(bits + w) = *(bits + w - 1);
+		bits = (uint32_t*)((char*)bits + pitch);
+	}
+	memcpy((char*)(start - 1) - pitch, start - 1, (w + 2) * sizeof(uint32_t));
+	memcpy(bits - 1, (char*)(bits - 1) - pitch, (w + 2) * sizeof(uint32_t));
+}
+
+static void OldClear(uint32_t* dst, ptrdiff_t pitch, size_t w, size_t h)
+{
+	uint32_t* block = (uint32_t*)calloc(w * h, sizeof(uint32_t));
+	OldPaste(dst, pitch, block, w * sizeof(uint32_t), w, h);
+	free(block);
+}
+
+int main()
+{
+	static const char* LEVELS[] = { "scalar", "sse2", "avx2" };
+	static const size_t SIZES[] = { 16, 64, 256 };
+
+	vector<uint32_t> atlas(ATLAS * ATLAS), sprite(256 * 256);
+	for (size_t i = 0; i < sprite.size(); i++)
+	{
+		sprite[i] = (uint32_t)rand();
+	}
+
+	ptrdiff_t pitch = ATLAS * sizeof(uint32_t);
+	printf("Supported kernels: %s\n\n", LEVELS[GetPixelOpsLevel()]);
+	printf("%-8s %6s %-8s %12s\n", "op", "size", "kernel", "Mpixel/s");
+
+	for (size_t s = 0; s < sizeof SIZES / sizeof SIZES[0]; s++)
+	{
+		size_t n     = SIZES[s];
+		size_t count = (ATLAS / (n + 2)) * (ATLAS / (n + 2));
+		double pixels = (double)n * n * count * REPEATS;
+
+		for (int op = 0; op < 3; op++)
+		{
+			for (int level = -1; level <= (int)GetPixelOpsLevel(); level++)
+			{
+				if (level >= 0)
+				{
+					SetPixelOpsLevel((PixelOpsLevel)level);
+				}
+
+				double start = Now();
+				for (int r = 0; r < REPEATS; r++)
+				{
+					for (size_t k = 0; k < count; k++)
+					{
+						size_t x = 1 + (k % (ATLAS / (n + 2))) * (n + 2);
+						size_t y = 1 + (k / (ATLAS / (n + 2))) * (n + 2);
+						uint32_t* dst = &atlas[y * ATLAS + x];
+						if (op == 0)
+						{
+							if (level < 0) OldPaste(dst, pitch, &sprite[0], n * 4, n, n);
+							else           CopyRect(dst, pitch, &sprite[0], n * 4, n, n);
+						}
+						else if (op == 1)
+						{
+							if (level < 0) OldBorder(dst, pitch, n, n);
+							else           ReplicateBorder(dst, pitch, n, n);
+						}
+						else
+						{
+							if (level < 0) OldClear(dst, pitch, n, n);
+							else           FillRect(dst, pitch, 0, n, n);
+						}
+					}
+				}
+				double seconds = Now() - start;
+
+				static const char* OPS[] = { "paste", "border", "clear" };
+				printf("%-8s %6u %-8s %12.1f\n", OPS[op], (unsigned)n, (level < 0) ? "old" : LEVELS[level],
+				       (seconds > 0) ? pixels / seconds / 1e6 : 0.0);
+			}
+		}
+	}
+	return 0;
+}
\ No newline at end of file
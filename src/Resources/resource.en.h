@@ -34,6 +34,7 @@
 #define IDS_FILES_ALL                   131
 #define IDS_FILES_IMAGE                 133
 #define IDS_FILES_MTD                   134
+#define IDS_ERROR_IMAGE_FULL            135
 #define IDC_LIST1                       1001
 #define IDC_STATIC_X                    1002
 #define IDC_STATIC_Y                    1003
@@ -48,6 +49,8 @@
 #define ID_EDIT_DELETEFILE              40005
 #define ID_EDIT_RENAMEFILE              40006
 #define ID_EDIT_EXTRACTFILE             40007
+#define ID_EDIT_REPACK                  40008
+#define ID_EDIT_MERGEDUPLICATES         40009
 
 // Next default values for new objects
 // 
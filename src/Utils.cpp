@@ -1,6 +1,12 @@
 #include "Utils.h"
+#include "resource.h"
+#include <stdarg.h>
+#include <stdlib.h>
+#include <wchar.h>
+#include <vector>
 using namespace std;
 
+#ifdef _WIN32
 wstring AnsiToWide(const char* cstr)
 {
 	int size = MultiByteToWideChar(CP_ACP, MB_PRECOMPOSED, cstr, -1, NULL, 0);
@@ -18,7 +24,28 @@ wstring AnsiToWide(const char* cstr)
 		throw;
 	}
 }
+#else
+wstring AnsiToWide(const char* cstr)
+{
+	size_t size = mbstowcs(NULL, cstr, 0);
+	if (size == (size_t)-1)
+	{
+		// Not valid in the current locale; pass the bytes through
+		wstring result;
+		for (; *cstr != '\0'; cstr++)
+		{
+			result += (wchar_t)(unsigned char)*cstr;
+		}
+		return result;
+	}
 
+	vector<wchar_t> wstr(size + 1);
+	mbstowcs(&wstr[0], cstr, size + 1);
+	return wstring(&wstr[0], size);
+}
+#endif
+
+#ifdef _WIN32
 static wstring FormatString(const wchar_t* format, va_list args)
 {
     int      n   = _vscwprintf(format, args);
@@ -36,6 +63,25 @@ static wstring FormatString(const wchar_t* format, va_list args)
         throw;
     }
 }
+#else
+static wstring FormatString(const wchar_t* format, va_list args)
+{
+	// vswprintf cannot tell how long the result would be, so grow until it fits
+	vector<wchar_t> buf(256);
+	for (;;)
+	{
+		va_list copy;
+		va_copy(copy, args);
+		int n = vswprintf(&buf[0], buf.size(), format, copy);
+		va_end(copy);
+		if (n >= 0 && (size_t)n < buf.size())
+		{
+			return wstring(&buf[0], n);
+		}
+		buf.resize(buf.size() * 2);
+	}
+}
+#endif
 
 wstring FormatString(const wchar_t* format, ...)
 {
@@ -46,7 +92,8 @@ wstring FormatString(const wchar_t* format, ...)
     return str;
 }
 
-wstring LoadString(UINT id, ...)
+#ifdef _WIN32
+wstring LoadString(unsigned int id, ...)
 {
     int len = 256;
     TCHAR* buf = new TCHAR[len];
@@ -70,4 +117,61 @@ wstring LoadString(UINT id, ...)
         delete[] buf;
         throw;
     }
-}
\ No newline at end of file
+}
+#else
+struct StringResource
+{
+	unsigned int   id;
+	const wchar_t* text;
+};
+
+static const StringResource StringTable[] =
+{
+	{ IDS_ERROR_UI_INITIALIZATION,   L"Unable to initialize UI" },
+	{ IDS_WARNING_EXTRACT_OVERWRITE, L"The following file already exists in the directory:\n\n%ls\n\nDo you wish to replace it?" },
+	{ IDS_OVERWRITE_TITLE,           L"Overwrite file?" },
+	{ IDS_ERROR_IMAGE_SAVE,          L"Unable to save image" },
+	{ IDS_ERROR_FILE_CREATE,         L"Unable to create file" },
+	{ IDS_ERROR_FILE_WRITE,          L"Unable to write to file" },
+	{ IDS_ERROR_BITMAP_COPY,         L"Unable to copy bitmap" },
+	{ IDS_ERROR_BITMAP_EXPAND,       L"Unable to expand bitmap" },
+	{ IDS_ERROR_FORMAT_UNSUPPORTED,  L"Unsupported image format" },
+	{ IDS_ERROR_IMAGE_LOAD,          L"Unable to load image" },
+	{ IDS_ERROR_IMAGE_CONVERT,       L"Unable to convert image" },
+	{ IDS_ERROR_FILE_OPEN,           L"Unable to open file" },
+	{ IDS_ERROR_FILE_READ,           L"Unable to read file" },
+	{ IDS_ERROR_BITMAP_CREATE,       L"Unable to create bitmap" },
+	{ IDS_QUERY_SAVE_MODIFICATIONS,  L"The file has been modified. Do you want to save the modifications?" },
+	{ IDS_WARNING,                   L"Warning" },
+	{ IDS_UNNAMED,                   L"Unnamed" },
+	{ IDS_ERROR_CORRUPT_ARCHIVE,     L"The archive has been opened as read-only because it appears corrupt.\n\nTo create a valid archive, extract all files and insert them into a new archive." },
+	{ IDS_ERROR_FILE_COUNT,          L"Too many files selected" },
+	{ IDS_TITLE_REPLACE,             L"Replace file?" },
+	{ IDS_WARNING_INSERT_OVERWRITE,  L"The following file already exists in the index:\n\n%ls\n\nDo you wish to replace it?" },
+	{ IDS_TITLE_EXTRACT_TARGET,      L"Please select the folder where you wish to extract the files to." },
+	{ IDS_INFORMATION,               L"Information" },
+	{ IDS_INFO_EXTRACTED,            L"The selected files have been extracted" },
+	{ IDS_INFO_NONE_EXTRACTED,       L"No files have been extracted" },
+	{ IDS_FILENAME,                  L"Filename" },
+	{ IDS_FILES_ALL,                 L"All Files" },
+	{ IDS_FILES_IMAGE,               L"All Image Files" },
+	{ IDS_FILES_MTD,                 L"MTD files" },
+	{ IDS_ERROR_IMAGE_FULL,          L"The files do not fit within the maximum image size" }
+};
+
+wstring LoadString(unsigned int id, ...)
+{
+	for (size_t i = 0; i < sizeof StringTable / sizeof StringTable[0]; i++)
+	{
+		if (StringTable[i].id == id)
+		{
+			va_list args;
+			va_start(args, id);
+			wstring str = FormatString(StringTable[i].text, args);
+			va_end(args);
+			return str;
+		}
+	}
+	return L"";
+}
+#endif
\ No newline at end of file
@@ -1,12 +1,17 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#endif
 #include <string>
 
 std::wstring AnsiToWide(const char* cstr);
 std::wstring FormatString(const wchar_t* format, ...);
-std::wstring LoadString(UINT id, ...);
+
+// Load and format a string resource. Outside of Windows, the strings come
+// from a built-in copy of the English string table.
+std::wstring LoadString(unsigned int id, ...);
 
 #endif
\ No newline at end of file
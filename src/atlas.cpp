@@ -0,0 +1,289 @@
+//
+// This file contains the administration of an atlas that consists of
+// several MTD/TGA file pairs.
+//
+// Every page is a regular FilePair with a maximum size. Files are inserted
+// into the first page that has room for them; when no page has room left, a
+// new page is opened instead of growing an existing page past the maximum.
+//
+#include <algorithm>
+#include <map>
+#include <sstream>
+
+#include "atlas.h"
+#include "fileio.h"
+#include "exceptions.h"
+#include "Utils.h"
+#include "resource.h"
+using namespace std;
+
+// New pages start out at this size
+static const unsigned long PAGE_WIDTH  = 256;
+static const unsigned long PAGE_HEIGHT = 256;
+
+wstring Atlas::getPageFilename(const wstring& filename, size_t page)
+{
+	if (page == 0)
+	{
+		return filename;
+	}
+
+	wstringstream suffix;
+	suffix << L"_" << page;
+
+	size_t dir = filename.find_last_of(L"\\/");
+	size_t ext = filename.find_last_of(L'.');
+	if (ext == wstring::npos || (dir != wstring::npos && ext < dir))
+	{
+		return filename + suffix.str();
+	}
+	return filename.substr(0, ext) + suffix.str() + filename.substr(ext);
+}
+
+size_t Atlas::getNumPages() const
+{
+	return pages.size();
+}
+
+FilePair& Atlas::getPage(size_t page)
+{
+	return *pages[page];
+}
+
+int Atlas::findPage(const wstring& filename) const
+{
+	for (size_t i = 0; i < pages.size(); i++)
+	{
+		if (pages[i]->getFileInfo(filename) != NULL)
+		{
+			return (int)i;
+		}
+	}
+	return -1;
+}
+
+void Atlas::setHeuristic(FreeArea::Heuristic heuristic)
+{
+	this->heuristic = heuristic;
+	for (size_t i = 0; i < pages.size(); i++)
+	{
+		pages[i]->setHeuristic(heuristic);
+	}
+}
+
+void Atlas::setCompaction(bool enable)
+{
+	compaction = enable;
+	for (size_t i = 0; i < pages.size(); i++)
+	{
+		pages[i]->setCompaction(enable);
+	}
+}
+
+void Atlas::setPageSetup(void (*setup)(FilePair& page, void* context), void* context)
+{
+	pageSetup   = setup;
+	pageContext = context;
+	for (size_t i = 0; i < pages.size(); i++)
+	{
+		pageSetup(*pages[i], pageContext);
+	}
+}
+
+void Atlas::setupPage(FilePair* page)
+{
+	page->setHeuristic(heuristic);
+	page->setCompaction(compaction);
+	page->setMaxSize(maxWidth, maxHeight);
+	if (pageSetup != NULL)
+	{
+		pageSetup(*page, pageContext);
+	}
+}
+
+FilePair* Atlas::createPage()
+{
+	unsigned long width  = (maxWidth  != 0 && maxWidth  < PAGE_WIDTH)  ? maxWidth  : PAGE_WIDTH;
+	unsigned long height = (maxHeight != 0 && maxHeight < PAGE_HEIGHT) ? maxHeight : PAGE_HEIGHT;
+
+	FilePair* page = new FilePair(width, height);
+	pages.push_back(page);
+	setupPage(page);
+	return page;
+}
+
+void Atlas::addPage(FilePair* page)
+{
+	pages.push_back(page);
+	setupPage(page);
+}
+
+void Atlas::open(const wstring& indexFilename, const wstring& imageFilename, bool lazy)
+{
+	for (size_t i = 0; ; i++)
+	{
+		wstring indexName = getPageFilename(indexFilename, i);
+		wstring imageName = getPageFilename(imageFilename, i);
+		if (i > 0 && (!FileExists(indexName) || !FileExists(imageName)))
+		{
+			break;
+		}
+		addPage( new FilePair(indexName, imageName, lazy) );
+	}
+}
+
+void Atlas::insertFiles(vector<wstring>& filenames)
+{
+	// Which page every file ended up on
+	map<wstring, size_t> placed;
+
+	vector<wstring> remaining = filenames;
+	size_t page = 0;
+	try
+	{
+		for (; !remaining.empty(); page++)
+		{
+			bool fresh = (page == pages.size());
+			if (fresh)
+			{
+				createPage();
+			}
+			else if (pages[page]->isReadOnly())
+			{
+				continue;
+			}
+
+			vector<wstring> overflow;
+			pages[page]->insertFiles(remaining, &overflow);
+			if (remaining.empty() && fresh)
+			{
+				// These files do not even fit on an empty page
+				delete pages.back();
+				pages.pop_back();
+				throw wruntime_error(LoadString(IDS_ERROR_IMAGE_FULL));
+			}
+
+			for (size_t i = 0; i < remaining.size(); i++)
+			{
+				placed[ GetIndexName(remaining[i]) ] = page;
+			}
+			remaining.swap(overflow);
+		}
+	}
+	catch (...)
+	{
+		// The files inserted before the error stay in: on the page that
+		// failed, those are the ones of the batch that it holds now. Their
+		// old copies go all the same, so no file is left on two pages.
+		for (size_t i = 0; page < pages.size() && i < remaining.size(); i++)
+		{
+			wstring name = GetIndexName(remaining[i]);
+			if (pages[page]->getFileInfo(name) != NULL)
+			{
+				placed[name] = page;
+			}
+		}
+		deleteStaleCopies(placed);
+		throw;
+	}
+	deleteStaleCopies(placed);
+}
+
+void Atlas::deleteStaleCopies(const map<wstring, size_t>& placed)
+{
+	// A replaced file can end up on another page than the one it was on
+	vector< vector<wstring> > stale(pages.size());
+	for (map<wstring, size_t>::const_iterator i = placed.begin(); i != placed.end(); i++)
+	{
+		for (size_t page = 0; page < pages.size(); page++)
+		{
+			if (page != i->second)
+			{
+				stale[page].push_back(i->first);
+			}
+		}
+	}
+	for (size_t page = 0; page < pages.size(); page++)
+	{
+		pages[page]->deleteFiles(stale[page]);
+	}
+}
+
+void Atlas::deleteFile(const wstring& filename)
+{
+	int page = findPage(filename);
+	if (page >= 0)
+	{
+		pages[page]->deleteFile(filename);
+	}
+}
+
+void Atlas::deleteFiles(const vector<wstring>& filenames)
+{
+	// Every page skips the names it does not have
+	for (size_t page = 0; page < pages.size(); page++)
+	{
+		pages[page]->deleteFiles(filenames);
+	}
+}
+
+void Atlas::save(const wstring& indexFilename, const wstring& imageFilename, FREE_IMAGE_FORMAT format)
+{
+	if (pages.empty())
+	{
+		// Even an empty atlas has its first page
+		createPage();
+	}
+
+	for (size_t i = pages.size() - 1; i > 0; i--)
+	{
+		if (pages[i]->getNumFiles() == 0)
+		{
+			delete pages[i];
+			pages.erase(pages.begin() + i);
+		}
+	}
+
+	for (size_t i = 0; i < pages.size(); i++)
+	{
+		wstring indexName = getPageFilename(indexFilename, i);
+		wstring imageName = getPageFilename(imageFilename, i);
+		if (pages[i]->getIndexFilename() == indexName && pages[i]->getImageFilename() == imageName)
+		{
+			// Still where it was read from; only rewrite what changed
+			pages[i]->save(format);
+		}
+		else
+		{
+			pages[i]->saveImage(imageName, format);
+			pages[i]->saveIndex(indexName);
+		}
+	}
+
+	// Remove the pages the atlas had before it shrank
+	for (size_t i = pages.size(); ; i++)
+	{
+		wstring indexName = getPageFilename(indexFilename, i);
+		wstring imageName = getPageFilename(imageFilename, i);
+		if (!FileExists(indexName) && !FileExists(imageName))
+		{
+			break;
+		}
+		RemoveFile(indexName);
+		RemoveFile(imageName);
+	}
+}
+
+Atlas::Atlas(unsigned long maxWidth, unsigned long maxHeight)
+	: maxWidth(maxWidth), maxHeight(maxHeight), heuristic(FreeArea::FIRST_FIT), compaction(false),
+	  pageSetup(NULL), pageContext(NULL)
+{
+}
+
+Atlas::~Atlas()
+{
+	for (size_t i = 0; i < pages.size(); i++)
+	{
+		delete pages[i];
+	}
+}
\ No newline at end of file
@@ -0,0 +1,76 @@
+//
+// This file defines the class that spreads files over several MTD/TGA file
+// pairs ("pages"), each of which is kept within a maximum image size
+//
+#ifndef ATLAS_H
+#define ATLAS_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include "filepair.h"
+
+class Atlas
+{
+	std::vector<FilePair*> pages;
+	unsigned long          maxWidth, maxHeight;
+	FreeArea::Heuristic    heuristic;
+	bool                   compaction;
+	void                 (*pageSetup)(FilePair& page, void* context);
+	void*                  pageContext;
+
+	FilePair* createPage();
+
+	// Apply the settings of the atlas to a page that is added to it
+	void setupPage(FilePair* page);
+
+	// Delete the files from every page but the one they were placed on
+	void deleteStaleCopies(const std::map<std::wstring, size_t>& placed);
+
+	// No copying
+	Atlas(const Atlas&);
+	Atlas& operator=(const Atlas&);
+
+public:
+	// Page filenames: page 0 uses the filename as is, page n > 0 gets
+	// "_n" inserted before the extension
+	static std::wstring getPageFilename(const std::wstring& filename, size_t page);
+
+	size_t    getNumPages() const;
+	FilePair& getPage(size_t page);
+
+	// Which page holds this file? Returns -1 if no page does.
+	int findPage(const std::wstring& filename) const;
+
+	void setHeuristic(FreeArea::Heuristic heuristic);
+	void setCompaction(bool enable);
+
+	// Have setup called for every page, existing or new, after the settings
+	// of the atlas itself, e.g. to set the other options of FilePair
+	void setPageSetup(void (*setup)(FilePair& page, void* context), void* context);
+
+	// Open the pages of an atlas saved under these names: page 0, and every
+	// page after it for which both files exist
+	void open(const std::wstring& indexFilename, const std::wstring& imageFilename, bool lazy = false);
+
+	// Insert files on the first pages that have room for them, opening new
+	// pages as needed. Files that already exist are replaced. When a file
+	// fails to load, the files inserted before it stay in, each on one page
+	// only, and the error is thrown afterwards.
+	void insertFiles(std::vector<std::wstring>& filenames);
+	void deleteFile(const std::wstring& filename);
+	void deleteFiles(const std::vector<std::wstring>& filenames);
+
+	// Take ownership of an existing page, e.g. one that has been opened
+	void addPage(FilePair* page);
+
+	// Save all pages, see getPageFilename for their names. Pages after the
+	// first one that have become empty are dropped, and the pages after
+	// them move up. Files of pages beyond the last one are deleted.
+	void save(const std::wstring& indexFilename, const std::wstring& imageFilename, FREE_IMAGE_FORMAT format = FIF_UNKNOWN);
+
+	Atlas(unsigned long maxWidth, unsigned long maxHeight);
+	~Atlas();
+};
+
+#endif
\ No newline at end of file
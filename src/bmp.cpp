@@ -0,0 +1,103 @@
+//
+// This file contains the BMP decoder.
+//
+#include <string.h>
+
+#include "bmp.h"
+#include "pixelops.h"
+#include "types.h"
+
+static const unsigned int FILE_HEADER_SIZE = 14;
+static const unsigned int INFO_HEADER_SIZE = 40;	// BITMAPINFOHEADER; later versions only add fields
+static const unsigned int BI_RGB           = 0;
+
+static inline uint32_t ReadLong(const unsigned char* p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline unsigned int ReadWord(const unsigned char* p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+bool ReadBmpHeader(const unsigned char* data, size_t size, BmpHeader& header)
+{
+	if (size < FILE_HEADER_SIZE + INFO_HEADER_SIZE || data[0] != 'B' || data[1] != 'M')
+	{
+		return false;
+	}
+
+	const unsigned char* info = data + FILE_HEADER_SIZE;
+	int32_t  width       = (int32_t)ReadLong(info + 4);
+	int32_t  height      = (int32_t)ReadLong(info + 8);
+	unsigned int bpp     = ReadWord(info + 14);
+	if (ReadLong(info) < INFO_HEADER_SIZE || ReadWord(info + 12) != 1 || (bpp != 24 && bpp != 32) ||
+		ReadLong(info + 16) != BI_RGB || width <= 0 || height == 0 || height == INT32_MIN)
+	{
+		// Not an uncompressed 24 or 32-bit image
+		return false;
+	}
+
+	// Compute the row size in 64 bits, so a hostile width cannot wrap it
+	// around where unsigned long is 32 bits wide
+	uint64_t offset = ReadLong(data + 10);
+	uint64_t stride = (((uint64_t)width * bpp + 31) / 32) * 4;
+	if (offset > size || stride > size - offset)
+	{
+		// Not even one row fits in the file
+		return false;
+	}
+
+	header.width   = width;
+	header.height  = (height < 0) ? -height : height;
+	header.bpp     = bpp;
+	header.topDown = (height < 0);
+	header.offset  = (size_t)offset;
+	header.stride  = (size_t)stride;
+	return true;
+}
+
+bool CheckBmpData(size_t size, const BmpHeader& header)
+{
+	return (size - header.offset) / header.stride >= header.height;
+}
+
+bool DecodeBmp(const unsigned char* data, size_t size, const BmpHeader& header, unsigned char* bits, size_t pitch, bool border)
+{
+	unsigned long width  = header.width;
+	unsigned long height = header.height;
+	if (!CheckBmpData(size, header))
+	{
+		return false;
+	}
+
+	const unsigned char* src = data + header.offset;
+	for (unsigned long r = 0; r < height; r++, src += header.stride)
+	{
+		unsigned long  y   = header.topDown ? height - r - 1 : r;
+		unsigned char* row = bits + y * pitch;
+		if (header.bpp == 32)
+		{
+			memcpy(row, src, (size_t)width * 4);
+		}
+		else
+		{
+			unsigned char*       dst = row;
+			const unsigned char* p   = src;
+			for (unsigned long x = 0; x < width; x++, dst += 4, p += 3)
+			{
+				dst[0] = p[0];
+				dst[1] = p[1];
+				dst[2] = p[2];
+				dst[3] = 0xFF;
+			}
+		}
+
+		if (border)
+		{
+			ReplicateRowBorder((uint32_t*)row, (ptrdiff_t)pitch, width, y, height);
+		}
+	}
+	return true;
+}
\ No newline at end of file
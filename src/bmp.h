@@ -0,0 +1,35 @@
+//
+// This file contains a small decoder for uncompressed 24 and 32-bit BMP
+// files. Other BMP files are left to FreeImage.
+//
+// Pixels are delivered as 32-bit BGRA rows, starting at the bottom row,
+// like the TGA codec does.
+//
+#ifndef BMP_H
+#define BMP_H
+
+#include <stddef.h>
+
+struct BmpHeader
+{
+	unsigned long width, height;
+	unsigned int  bpp;			// 24 or 32
+	bool          topDown;		// First row in the file is the top row
+	size_t        offset;		// Offset of the pixel data in the file
+	size_t        stride;		// Bytes per row in the file
+};
+
+// Parse the headers of a BMP file. Returns false if this is not an image
+// this decoder can handle.
+bool ReadBmpHeader(const unsigned char* data, size_t size, BmpHeader& header);
+
+// Check that all of the pixel data is there, given the size of the file.
+// DecodeBmp cannot fail on a file that passes.
+bool CheckBmpData(size_t size, const BmpHeader& header);
+
+// Decode the pixel data into bits (bottom row first, pitch bytes apart).
+// With border, the 1px border around the pixels is filled as well, like
+// DecodeTga does. Returns false if the data is truncated.
+bool DecodeBmp(const unsigned char* data, size_t size, const BmpHeader& header, unsigned char* bits, size_t pitch, bool border = false);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,141 @@
+//
+// This file contains the reading and writing of the build cache.
+//
+#include <string.h>
+#include <vector>
+
+#include "buildcache.h"
+#include "fileio.h"
+using namespace std;
+
+static const char     CACHE_MAGIC[4] = { 'M', 'T', 'D', 'C' };
+static const uint32_t CACHE_VERSION  = 1;
+
+// Layout of the file (little-endian)
+#pragma pack(1)
+struct CACHEHEADER
+{
+	char     magic[4];
+	uint32_t version;
+	uint64_t indexHash;
+	uint64_t imageHash;
+	uint32_t count;
+};
+
+struct CACHEENTRY
+{
+	char     name[64];
+	uint64_t hash;
+	uint32_t x, y, w, h;
+};
+#pragma pack()
+
+uint64_t HashBytes(const void* data, size_t size)
+{
+	// FNV-1a over 64-bit words, with a final mix so the high bits depend on
+	// every input bit as well
+	const uint64_t PRIME = 0x100000001b3ULL;
+	const unsigned char* p = (const unsigned char*)data;
+	uint64_t hash = 0xcbf29ce484222325ULL ^ size;
+
+	for (; size >= 8; p += 8, size -= 8)
+	{
+		uint64_t word;
+		memcpy(&word, p, 8);
+		hash = (hash ^ letohll(word)) * PRIME;
+	}
+	for (; size > 0; p++, size--)
+	{
+		hash = (hash ^ *p) * PRIME;
+	}
+
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+bool HashFile(const wstring& filename, uint64_t& hash)
+{
+	MappedFile file;
+	if (!file.open(filename))
+	{
+		return false;
+	}
+	hash = HashBytes(file.data(), file.size());
+	return true;
+}
+
+bool ReadBuildCache(const wstring& filename, uint64_t& indexHash, uint64_t& imageHash, BuildCache& cache)
+{
+	cache.clear();
+
+	MappedFile file;
+	if (!file.open(filename) || file.size() < sizeof(CACHEHEADER))
+	{
+		return false;
+	}
+
+	CACHEHEADER header;
+	memcpy(&header, file.data(), sizeof header);
+	unsigned long count = letohl(header.count);
+	if (memcmp(header.magic, CACHE_MAGIC, sizeof CACHE_MAGIC) != 0 || letohl(header.version) != CACHE_VERSION ||
+		(file.size() - sizeof header) / sizeof(CACHEENTRY) < count)
+	{
+		return false;
+	}
+	indexHash = letohll(header.indexHash);
+	imageHash = letohll(header.imageHash);
+
+	const CACHEENTRY* entries = (const CACHEENTRY*)(file.data() + sizeof header);
+	for (unsigned long i = 0; i < count; i++)
+	{
+		CacheEntry entry;
+		entry.hash = letohll(entries[i].hash);
+		entry.placement.x = letohl(entries[i].x);
+		entry.placement.y = letohl(entries[i].y);
+		entry.placement.w = letohl(entries[i].w);
+		entry.placement.h = letohl(entries[i].h);
+		entry.placement.used = 1;
+
+		const char* end = (const char*)memchr(entries[i].name, '\0', 63);
+		cache.insert( cache.end(), make_pair(DecodeIndexName(entries[i].name, (end != NULL) ? end - entries[i].name : 63), entry) );
+	}
+	return true;
+}
+
+bool WriteBuildCache(const wstring& filename, uint64_t indexHash, uint64_t imageHash, const BuildCache& cache, bool sync)
+{
+	vector<unsigned char> buffer(sizeof(CACHEHEADER) + cache.size() * sizeof(CACHEENTRY));
+
+	CACHEHEADER header;
+	memcpy(header.magic, CACHE_MAGIC, sizeof CACHE_MAGIC);
+	header.version   = htolel(CACHE_VERSION);
+	header.indexHash = htolell(indexHash);
+	header.imageHash = htolell(imageHash);
+	header.count     = htolel((uint32_t)cache.size());
+	memcpy(&buffer[0], &header, sizeof header);
+
+	CACHEENTRY* output = (CACHEENTRY*)&buffer[sizeof header];
+	for (BuildCache::const_iterator i = cache.begin(); i != cache.end(); i++, output++)
+	{
+		EncodeIndexName(i->first, output->name);
+		output->hash = htolell(i->second.hash);
+		output->x    = htolel(i->second.placement.x);
+		output->y    = htolel(i->second.placement.y);
+		output->w    = htolel(i->second.placement.w);
+		output->h    = htolel(i->second.placement.h);
+	}
+
+	// Write a temporary file first, like the index and image
+	wstring tempname = GetTempFilename(filename);
+	OutputFile file;
+	bool written = file.create(tempname) && file.write(&buffer[0], buffer.size()) && (!sync || file.sync());
+	file.close();
+	if (!written || !RenameFile(tempname, filename))
+	{
+		RemoveFile(tempname);
+		return false;
+	}
+	return true;
+}
\ No newline at end of file
@@ -0,0 +1,38 @@
+//
+// This file defines the build cache, a file next to an MTD index that lets
+// an atlas be brought up to date with its source files incrementally. It
+// records a hash of the contents of every source file and where the file
+// was placed, along with hashes of the MTD and TGA file it belongs to, so
+// a cache that does not match the atlas anymore is recognized.
+//
+#ifndef BUILDCACHE_H
+#define BUILDCACHE_H
+
+#include <string>
+#include <map>
+
+#include "mtdindex.h"
+
+struct CacheEntry
+{
+	uint64_t hash;			// Hash of the contents of the source file
+	FileInfo placement;		// Area in the image, as in the index
+};
+
+// Entries by index name
+typedef std::map<std::wstring, CacheEntry> BuildCache;
+
+// Hash of a block of memory, for telling files apart
+uint64_t HashBytes(const void* data, size_t size);
+
+// Hash the contents of a file. Returns false if it cannot be read.
+bool HashFile(const std::wstring& filename, uint64_t& hash);
+
+// Read a cache, along with the hashes of the index and image it was made
+// for. Returns false if the file is missing or not a valid cache.
+bool ReadBuildCache(const std::wstring& filename, uint64_t& indexHash, uint64_t& imageHash, BuildCache& cache);
+
+// Replace the cache file. Returns false if that failed.
+bool WriteBuildCache(const std::wstring& filename, uint64_t indexHash, uint64_t imageHash, const BuildCache& cache, bool sync);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,422 @@
+//
+// This file contains the Win32 and POSIX implementations of the file layer.
+//
+#include <algorithm>
+
+#include "fileio.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <vector>
+#endif
+using namespace std;
+
+#ifndef _WIN32
+string NarrowFilename(const wstring& filename)
+{
+	size_t size = wcstombs(NULL, filename.c_str(), 0);
+	if (size == (size_t)-1)
+	{
+		return string();
+	}
+	vector<char> buf(size + 1);
+	wcstombs(&buf[0], filename.c_str(), size + 1);
+	return string(&buf[0], size);
+}
+
+// Convert a filename from the multibyte encoding of the current locale
+static wstring WideFilename(const char* filename)
+{
+	size_t size = mbstowcs(NULL, filename, 0);
+	if (size == (size_t)-1)
+	{
+		return wstring();
+	}
+	vector<wchar_t> buf(size + 1);
+	mbstowcs(&buf[0], filename, size + 1);
+	return wstring(&buf[0], size);
+}
+#endif
+
+// Join a directory and a name from it
+static wstring JoinPath(const wstring& directory, const wstring& name)
+{
+	if (!directory.empty() && directory[directory.length() - 1] != L'/' && directory[directory.length() - 1] != L'\\')
+	{
+#ifdef _WIN32
+		return directory + L'\\' + name;
+#else
+		return directory + L'/' + name;
+#endif
+	}
+	return directory + name;
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const wstring& filename)
+{
+	close();
+
+	HANDLE hFile = CreateFile(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	m_file = hFile;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(hFile, &size) || (unsigned long long)size.QuadPart > (size_t)-1)
+	{
+		close();
+		return false;
+	}
+
+	m_size = (size_t)size.QuadPart;
+	if (m_size > 0)
+	{
+		// Mapping an empty file is not allowed, so those have no view
+		m_mapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (m_mapping == NULL || (m_data = (const unsigned char*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0)) == NULL)
+		{
+			close();
+			return false;
+		}
+	}
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (m_data != NULL)
+	{
+		UnmapViewOfFile(m_data);
+	}
+	if (m_mapping != NULL)
+	{
+		CloseHandle(m_mapping);
+	}
+	if (m_file != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(m_file);
+	}
+	m_data    = NULL;
+	m_size    = 0;
+	m_mapping = NULL;
+	m_file    = INVALID_HANDLE_VALUE;
+}
+
+MappedFile::MappedFile()
+	: m_data(NULL), m_size(0), m_file(INVALID_HANDLE_VALUE), m_mapping(NULL)
+{
+}
+
+
+bool OutputFile::create(const wstring& filename)
+{
+	close();
+
+	HANDLE hFile = CreateFile(filename.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	m_file = hFile;
+	return true;
+}
+
+bool OutputFile::open(const wstring& filename)
+{
+	close();
+
+	HANDLE hFile = CreateFile(filename.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	m_file = hFile;
+	return true;
+}
+
+bool OutputFile::writeAt(unsigned long long offset, const void* data, size_t size)
+{
+	LARGE_INTEGER pos;
+	pos.QuadPart = offset;
+	return SetFilePointerEx(m_file, pos, NULL, FILE_BEGIN) && write(data, size);
+}
+
+bool OutputFile::write(const void* data, size_t size)
+{
+	const char* p = (const char*)data;
+	while (size > 0)
+	{
+		// WriteFile takes a 32-bit size
+		DWORD chunk = (DWORD)min(size, (size_t)0x40000000), written;
+		if (!WriteFile(m_file, p, chunk, &written, NULL) || written != chunk)
+		{
+			return false;
+		}
+		p    += chunk;
+		size -= chunk;
+	}
+	return true;
+}
+
+bool OutputFile::sync()
+{
+	return FlushFileBuffers(m_file) != FALSE;
+}
+
+void OutputFile::close()
+{
+	if (m_file != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(m_file);
+	}
+	m_file = INVALID_HANDLE_VALUE;
+}
+
+OutputFile::OutputFile()
+	: m_file(INVALID_HANDLE_VALUE)
+{
+}
+
+bool RenameFile(const wstring& source, const wstring& target)
+{
+	return MoveFileEx(source.c_str(), target.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != FALSE;
+}
+
+void RemoveFile(const wstring& filename)
+{
+	DeleteFile(filename.c_str());
+}
+
+bool FileExists(const wstring& filename)
+{
+	DWORD attributes = GetFileAttributes(filename.c_str());
+	return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY) == 0;
+}
+
+bool ListFiles(const wstring& directory, vector<wstring>& filenames)
+{
+	WIN32_FIND_DATA data;
+	HANDLE hFind = FindFirstFile(JoinPath(directory, L"*").c_str(), &data);
+	if (hFind == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	size_t first = filenames.size();
+	do
+	{
+		if ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
+		{
+			filenames.push_back( JoinPath(directory, data.cFileName) );
+		}
+	} while (FindNextFile(hFind, &data));
+	FindClose(hFind);
+
+	sort(filenames.begin() + first, filenames.end());
+	return true;
+}
+
+#else
+
+bool MappedFile::open(const wstring& filename)
+{
+	close();
+
+	string name = NarrowFilename(filename);
+	if (name.empty() || (m_file = ::open(name.c_str(), O_RDONLY)) < 0)
+	{
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(m_file, &st) != 0 || (unsigned long long)st.st_size > (size_t)-1)
+	{
+		close();
+		return false;
+	}
+
+	m_size = (size_t)st.st_size;
+	if (m_size > 0)
+	{
+		void* view = mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, m_file, 0);
+		if (view == MAP_FAILED)
+		{
+			close();
+			return false;
+		}
+		madvise(view, m_size, MADV_SEQUENTIAL);
+		m_data = (const unsigned char*)view;
+	}
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (m_data != NULL)
+	{
+		munmap((void*)m_data, m_size);
+	}
+	if (m_file >= 0)
+	{
+		::close(m_file);
+	}
+	m_data = NULL;
+	m_size = 0;
+	m_file = -1;
+}
+
+MappedFile::MappedFile()
+	: m_data(NULL), m_size(0), m_file(-1)
+{
+}
+
+
+bool OutputFile::create(const wstring& filename)
+{
+	close();
+
+	string name = NarrowFilename(filename);
+	return !name.empty() && (m_file = ::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666)) >= 0;
+}
+
+bool OutputFile::open(const wstring& filename)
+{
+	close();
+
+	string name = NarrowFilename(filename);
+	return !name.empty() && (m_file = ::open(name.c_str(), O_WRONLY)) >= 0;
+}
+
+bool OutputFile::writeAt(unsigned long long offset, const void* data, size_t size)
+{
+	const char* p = (const char*)data;
+	while (size > 0)
+	{
+		ssize_t written = pwrite(m_file, p, size, (off_t)offset);
+		if (written < 0)
+		{
+			if (errno == EINTR) continue;
+			return false;
+		}
+		p      += written;
+		size   -= written;
+		offset += written;
+	}
+	return true;
+}
+
+bool OutputFile::write(const void* data, size_t size)
+{
+	const char* p = (const char*)data;
+	while (size > 0)
+	{
+		ssize_t written = ::write(m_file, p, size);
+		if (written < 0)
+		{
+			if (errno == EINTR) continue;
+			return false;
+		}
+		p    += written;
+		size -= written;
+	}
+	return true;
+}
+
+bool OutputFile::sync()
+{
+	return fsync(m_file) == 0;
+}
+
+void OutputFile::close()
+{
+	if (m_file >= 0)
+	{
+		::close(m_file);
+	}
+	m_file = -1;
+}
+
+OutputFile::OutputFile()
+	: m_file(-1)
+{
+}
+
+bool RenameFile(const wstring& source, const wstring& target)
+{
+	string from = NarrowFilename(source), to = NarrowFilename(target);
+	return !from.empty() && !to.empty() && rename(from.c_str(), to.c_str()) == 0;
+}
+
+void RemoveFile(const wstring& filename)
+{
+	string name = NarrowFilename(filename);
+	if (!name.empty())
+	{
+		unlink(name.c_str());
+	}
+}
+
+bool FileExists(const wstring& filename)
+{
+	struct stat st;
+	string name = NarrowFilename(filename);
+	return !name.empty() && stat(name.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+bool ListFiles(const wstring& directory, vector<wstring>& filenames)
+{
+	string name = NarrowFilename(directory);
+	DIR* dir = name.empty() ? NULL : opendir(name.c_str());
+	if (dir == NULL)
+	{
+		return false;
+	}
+
+	size_t first = filenames.size();
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		struct stat st;
+		string path = name + '/' + entry->d_name;
+		wstring filename = WideFilename(entry->d_name);
+		if (!filename.empty() && stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+		{
+			filenames.push_back( JoinPath(directory, filename) );
+		}
+	}
+	closedir(dir);
+
+	sort(filenames.begin() + first, filenames.end());
+	return true;
+}
+
+#endif
+
+wstring GetTempFilename(const wstring& filename)
+{
+	return filename + L".tmp";
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+OutputFile::~OutputFile()
+{
+	close();
+}
\ No newline at end of file
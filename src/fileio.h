@@ -0,0 +1,99 @@
+//
+// This file contains a small platform layer for file access, so the MTD
+// code does not have to talk to the Win32 API directly.
+//
+#ifndef FILEIO_H
+#define FILEIO_H
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+
+// Read-only view of a complete file. The file is mapped into memory where
+// possible; the view stays valid until the object is closed or destroyed.
+class MappedFile
+{
+	const unsigned char* m_data;
+	size_t               m_size;
+#ifdef _WIN32
+	void*                m_file;
+	void*                m_mapping;
+#else
+	int                  m_file;
+#endif
+
+	// No copying
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+public:
+	// Open and map the file; returns false if that failed
+	bool open(const std::wstring& filename);
+	void close();
+
+	const unsigned char* data() const { return m_data; }
+	size_t               size() const { return m_size; }
+
+	MappedFile();
+	~MappedFile();
+};
+
+// File that is written from start to end
+class OutputFile
+{
+#ifdef _WIN32
+	void* m_file;
+#else
+	int   m_file;
+#endif
+
+	// No copying
+	OutputFile(const OutputFile&);
+	OutputFile& operator=(const OutputFile&);
+
+public:
+	// Create or truncate the file; returns false if that failed
+	bool create(const std::wstring& filename);
+
+	// Open an existing file without truncating it; returns false if that failed
+	bool open(const std::wstring& filename);
+
+	// Write all of data; returns false if not everything was written
+	bool write(const void* data, size_t size);
+
+	// Write all of data at offset from the start of the file
+	bool writeAt(unsigned long long offset, const void* data, size_t size);
+
+	// Flush the contents to the disk; returns false if that failed
+	bool sync();
+
+	void close();
+
+	OutputFile();
+	~OutputFile();
+};
+
+// Name of the temporary file that is written before it replaces filename
+std::wstring GetTempFilename(const std::wstring& filename);
+
+// Move source over target in a single step; returns false if that failed
+bool RenameFile(const std::wstring& source, const std::wstring& target);
+
+// Delete a file, if it exists
+void RemoveFile(const std::wstring& filename);
+
+// Is there a file (not a directory) by this name?
+bool FileExists(const std::wstring& filename);
+
+// Append the files (not the subdirectories) in a directory to filenames,
+// sorted by name. Returns false if it is not a directory that can be read.
+bool ListFiles(const std::wstring& directory, std::vector<std::wstring>& filenames);
+
+#ifndef _WIN32
+// Convert a filename to the multibyte encoding of the current locale, for
+// APIs that only take narrow strings. Returns an empty string if it cannot
+// be represented.
+std::string NarrowFilename(const std::wstring& filename);
+#endif
+
+#endif
\ No newline at end of file
@@ -11,123 +11,393 @@
 // up at the wrong places due to rasterization rounding errors when using the
 // image as a texture for the GUI primitives.
 //
+// Files with identical pixels can share one area: their entries in the MTD
+// then have the same x,y,w,h. Such entries are called aliases here. An area
+// is only freed when the last entry that uses it is gone.
+//
 #include <algorithm>
 #include <fstream>
+#include <mutex>
+#include <set>
+#include <string.h>
 
 #include "filepair.h"
-#include "freeimage.h"
+#include "fileio.h"
+#include "tga.h"
+#include "bmp.h"
+#include "pixelops.h"
+#include "parallel.h"
+#include "buildcache.h"
+#include "FreeImage.h"
 #include "freearea.h"
 #include "exceptions.h"
 #include "Utils.h"
 #include "resource.h"
 using namespace std;
 
-#pragma pack(1)
-struct FILEINFO
-{
-	char name[64];
-	uint32_t x, y, w, h;
-	uint8_t used;
-};
-#pragma pack()
-
 static const int IMAGE = 1;
 static const int INDEX = 2;
 
+//
+// FreeImage only takes wide-character filenames on Windows; elsewhere the
+// names are converted to the encoding of the current locale first.
+//
+static FREE_IMAGE_FORMAT GetFormatFromName( const wstring& filename )
+{
+#ifdef _WIN32
+	return FreeImage_GetFIFFromFilenameU( filename.c_str() );
+#else
+	return FreeImage_GetFIFFromFilename( NarrowFilename(filename).c_str() );
+#endif
+}
+
+// Determine the format from the contents of the file, or its name if that fails
+static FREE_IMAGE_FORMAT GetFormatFromFile( const wstring& filename )
+{
+#ifdef _WIN32
+	FREE_IMAGE_FORMAT fif = FreeImage_GetFileTypeU( filename.c_str(), 0 );
+#else
+	FREE_IMAGE_FORMAT fif = FreeImage_GetFileType( NarrowFilename(filename).c_str(), 0 );
+#endif
+	return (fif != FIF_UNKNOWN) ? fif : GetFormatFromName(filename);
+}
+
+// FreeImage does not promise that every format plugin can load or save from
+// several threads at once, so the workers take turns. TGA and BMP files are
+// mostly handled by our own codecs, which need no lock.
+static mutex FreeImageLock;
+
+static FIBITMAP* LoadImageFile( FREE_IMAGE_FORMAT fif, const wstring& filename, int flags )
+{
+	lock_guard<mutex> guard(FreeImageLock);
+#ifdef _WIN32
+	return FreeImage_LoadU( fif, filename.c_str(), flags );
+#else
+	return FreeImage_Load( fif, NarrowFilename(filename).c_str(), flags );
+#endif
+}
+
+static bool SaveImageFile( FREE_IMAGE_FORMAT fif, FIBITMAP* dib, const wstring& filename )
+{
+	lock_guard<mutex> guard(FreeImageLock);
+#ifdef _WIN32
+	return FreeImage_SaveU( fif, dib, filename.c_str(), 0 ) != FALSE;
+#else
+	return FreeImage_Save( fif, dib, NarrowFilename(filename).c_str(), 0 ) != FALSE;
+#endif
+}
+
 class FilePair::FilePairImpl
 {
 	// Read a bitmap file
 	static FIBITMAP* ReadBitmapFile( const wstring& filename );
 
-	// Make sure to call this AFTER ReadBitmapFile; it uses the size of bitmap.bitmap to validate the index values
-	void ReadIndexFile( const wstring& filename );
+	// Read the index of a width by height image; the size is used to validate the index values
+	void ReadIndexFile( const wstring& filename, unsigned long width, unsigned long height );
+
+	// A planned move of a file within the image
+	struct Relocation
+	{
+		FileInfo*     fi;
+		unsigned long x, y;		// New position, including border
+	};
+
+	// Find a place for every area (width and height filled in) in freearea,
+	// growing the width-by-height image as needed, up to the maximum size.
+	// Only sizes are involved; no bitmap is touched, so the caller can
+	// allocate the final image once. If moves is not NULL, moving a few files
+	// is tried before growing. The indices of the areas that do not fit
+	// are returned in unplaced.
+	void PlanLayout( FreeArea& freearea, FreeArea::Heuristic heuristic, vector<FreeArea::RECT>& areas, unsigned long& width, unsigned long& height, vector<Relocation>* moves, vector<size_t>& unplaced ) const;
+
+	// Try to make room for area inside the width-by-height image by moving
+	// at most MAX_RELOCATIONS files elsewhere. Only plans the moves.
+	bool PlanRelocation( FreeArea& freearea, FreeArea::Heuristic heuristic, FreeArea::RECT& area, unsigned long width, unsigned long height, vector<Relocation>& moves ) const;
+
+	// Carry out planned moves; aliases of a moved file go along with it
+	void Relocate( const vector<Relocation>& moves );
+
+	// Position of a file in the image; aliases have the same one
+	typedef pair<unsigned long, unsigned long> Position;
+
+	// Take the files with the same pixels as an earlier one, or as a file in
+	// the index, out of the decoded files. They are returned in aliases,
+	// along with the index name of the file whose area they get.
+	void findDuplicates( vector<wstring>& filenames, vector<FIBITMAP*>& bitmaps, vector<FreeArea::RECT>& areas, const vector<uint64_t>& hashes, vector< pair<wstring, wstring> >& aliases ) const;
+
+	// Clear and free the areas of files that have been taken out of the
+	// index, unless an entry that is still in the index uses them
+	void releaseAreas( const vector<FileInfo>& removed, vector<FreeArea::RECT>& released );
 
 public:
 	FileInfo* selected;			// Currently selected file
 	wstring    indexFilename;	// MTD filename
 	wstring    imageFilename;	// TGA filename
 	FreeArea  freearea;			// Free/Used rectangle administration
-	FIBITMAP* bitmap;			// The bitmap
+	FreeArea::Heuristic heuristic;	// Placement heuristic for inserted files
+	bool      compaction;		// Move files around before growing the image?
+	unsigned long maxWidth;		// Maximum size of the image (0 = unlimited)
+	unsigned long maxHeight;
+	bool      syncOnSave;		// Flush saved files to the disk?
+	bool      compressImage;	// Save TGA images with RLE?
+	bool      lowMemory;		// Decode inserted files one at a time?
+	bool      mergeOnInsert;	// Let inserted duplicates share an area?
+	FIBITMAP* bitmap;			// The bitmap, NULL until first needed when opened lazily
+	unsigned long lazyWidth;	// Size of the image file, while bitmap is NULL
+	unsigned long lazyHeight;
+	vector<TgaRowStart> rowTable;	// Row starts in the RLE image file, while bitmap is NULL
 	bool      readOnly;			// Is the file read-only?
+	vector<IndexProblem> problems;	// Why, if the index is corrupt
 	int       modified;			// bit0 = image has been modified, bit1 = index has been modified
+								// (a rename only touches the index)
 
 	map<wstring, FileInfo> files;
+	vector<FreeArea::RECT> dirty;	// Areas of the image changed since the last save
+
+	// Remember that an area (including border) of the image changed
+	void markDirty( unsigned long x, unsigned long y, unsigned long w, unsigned long h );
+
+	// Write only the dirty rows over the existing image file, if that is an
+	// uncompressed 32-bit TGA of the same size. Returns false, without
+	// touching the file, if it is not. Unlike a full save this is not atomic:
+	// a crash halfway leaves a partly updated image. The rows are flushed to
+	// the disk before it returns, so the index is only saved after them.
+	bool patchImage(const std::wstring& filename);
+
+	// Decode the image file if that has not been done yet
+	void ensureBitmap();
+
+	// Map the image file to decode single files from it, building the row
+	// table first if needed. Returns false if the image has been decoded
+	// already or its format does not allow this.
+	bool openImageFile(MappedFile& file, TgaHeader& header);
+
+	// Get a copy of the pixels of a file. If the image has not been decoded
+	// yet, only the rows of the file are read, when the format allows it.
+	FIBITMAP* copyArea(const FileInfo& fi);
+
+	// Same, decoding from file if the image has not been decoded yet.
+	// Does not change anything, so threads can share it.
+	FIBITMAP* copyArea(const FileInfo& fi, const MappedFile& file, const TgaHeader& header) const;
+
+	// Work items of insertFiles: reading the files, and drawing them once placed
+	struct ReadJob;
+	static void ReadWorker(size_t index, void* context);
+	struct PasteJob;
+	static void PasteWorker(size_t index, void* context);
+
+	// Work item of findDuplicates and mergeDuplicates
+	struct HashJob;
+	static void HashWorker(size_t index, void* context);
+
+	// Work item of updateFiles
+	struct UpdateJob;
+	static void UpdateWorker(size_t index, void* context);
+
+	// Work item of extractFiles
+	struct ExtractJob;
+	static void ExtractWorker(size_t index, void* context);
 
 	// Saving
 	void saveIndex(const std::wstring& filename);
 	void saveImage(const std::wstring& filename, FREE_IMAGE_FORMAT format);
-	void saveBitmapFile(const FileInfo& fi, FIBITMAP* bitmap, const wstring& filename, FREE_IMAGE_FORMAT format);
+	void saveBitmapFile(const FileInfo& fi, const wstring& filename, FREE_IMAGE_FORMAT format);
+	void extractFiles( const vector<wstring>& filenames, const vector<wstring>& targets, vector<wstring>& errors, FREE_IMAGE_FORMAT format );
 
 	// Insertion
-	void insertFiles( vector<wstring>& filenames );
+	void insertFiles( vector<wstring>& filenames, vector<wstring>* overflow );
+	void updateFiles( vector<wstring>& filenames );
+
+	// Deletion
+	void deleteFiles( const vector<wstring>& filenames );
+
+	// Re-place all files and shrink the image
+	void repack( FreeArea::Heuristic heuristic );
+
+	// Let files with the same pixels share an area
+	size_t mergeDuplicates();
 
 	FilePairImpl( unsigned int width, unsigned int height);
-	FilePairImpl( const wstring& filename1, const wstring& filename2);
+	FilePairImpl( const wstring& filename1, const wstring& filename2, bool lazy);
 	~FilePairImpl();
 };
 
+void FilePair::FilePairImpl::markDirty( unsigned long x, unsigned long y, unsigned long w, unsigned long h )
+{
+	FreeArea::RECT rect = {x, y, w, h};
+	dirty.push_back(rect);
+}
+
+static bool CompareTop( const FreeArea::RECT& r1, const FreeArea::RECT& r2 )
+{
+	return r1.y < r2.y;
+}
+
+bool FilePair::FilePairImpl::patchImage(const std::wstring& filename)
+{
+	unsigned long width  = FreeImage_GetWidth(bitmap);
+	unsigned long height = FreeImage_GetHeight(bitmap);
+	unsigned long pitch  = width * sizeof(uint32_t);
+	if (FI_RGBA_RED != 2 || FI_RGBA_BLUE != 0 || FreeImage_GetPitch(bitmap) != pitch)
+	{
+		// The in-memory pixels are not stored like TGA pixels
+		return false;
+	}
+
+	// Check the header of the file on disk
+	unsigned long long offset;
+	bool bottomUp;
+	{
+		MappedFile file;
+		if (!file.open(filename) || file.size() < 18)
+		{
+			return false;
+		}
+
+		const unsigned char* header = file.data();
+		unsigned long colorMapSize = (header[5] | (header[6] << 8)) * ((header[7] + 7) / 8);
+		if (header[1] != 0 || header[2] != 2 || header[16] != 32 || (header[17] & 0x10) != 0 ||
+			(unsigned long)(header[12] | (header[13] << 8)) != width ||
+			(unsigned long)(header[14] | (header[15] << 8)) != height)
+		{
+			// Not an uncompressed, left-to-right 32-bit truecolor image of this size
+			return false;
+		}
+
+		offset   = 18 + header[0] + colorMapSize;
+		bottomUp = (header[17] & 0x20) == 0;
+		if (file.size() < offset + (unsigned long long)pitch * height)
+		{
+			return false;
+		}
+	}
+
+	// Merge the dirty areas into runs of rows
+	sort(dirty.begin(), dirty.end(), CompareTop);
+	vector< pair<unsigned long, unsigned long> > rows;
+	for (size_t i = 0; i < dirty.size(); i++)
+	{
+		unsigned long top    = min(dirty[i].y, height);
+		unsigned long bottom = min(dirty[i].y + dirty[i].h, height);
+		if (!rows.empty() && top <= rows.back().second)
+		{
+			rows.back().second = max(rows.back().second, bottom);
+		}
+		else if (top < bottom)
+		{
+			rows.push_back( make_pair(top, bottom) );
+		}
+	}
+
+	OutputFile file;
+	if (!file.open(filename))
+	{
+		return false;
+	}
+
+	for (size_t i = 0; i < rows.size(); i++)
+	{
+		if (bottomUp)
+		{
+			// The file and the bitmap store the rows in the same order
+			unsigned long first = height - rows[i].second;
+			if (!file.writeAt(offset + (unsigned long long)first * pitch, FreeImage_GetScanLine(bitmap, first), (rows[i].second - rows[i].first) * pitch))
+			{
+				throw wruntime_error(LoadString(IDS_ERROR_IMAGE_SAVE));
+			}
+		}
+		else for (unsigned long y = rows[i].first; y < rows[i].second; y++)
+		{
+			if (!file.writeAt(offset + (unsigned long long)y * pitch, FreeImage_GetScanLine(bitmap, height - y - 1), pitch))
+			{
+				throw wruntime_error(LoadString(IDS_ERROR_IMAGE_SAVE));
+			}
+		}
+	}
+
+	// Always flush: the index that is saved next must not reach the disk
+	// before the areas it refers to
+	if (!file.sync())
+	{
+		throw wruntime_error(LoadString(IDS_ERROR_IMAGE_SAVE));
+	}
+	return true;
+}
+
 void FilePair::FilePairImpl::saveImage(const std::wstring& filename, FREE_IMAGE_FORMAT format)
 {
+	ensureBitmap();
+
 	// Save the texture
 	if (format == FIF_UNKNOWN)
 	{
-		format = FreeImage_GetFIFFromFilenameU( filename.c_str() );
+		format = GetFormatFromName( filename );
 	}
 
-	if (!FreeImage_SaveU(format, bitmap, filename.c_str(), 0 ))
+	// If only a few areas of the file we loaded from changed, write just those
+	if (format == FIF_TARGA && filename == imageFilename && (modified & IMAGE) && !dirty.empty() && patchImage(filename))
+	{
+		dirty.clear();
+		modified &= ~IMAGE;
+		return;
+	}
+
+	// Write a temporary file first, so a failed save leaves the old image intact
+	wstring tempname = GetTempFilename(filename);
+	bool saved;
+	if (format == FIF_TARGA && FI_RGBA_RED == 2 && FI_RGBA_BLUE == 0)
+	{
+		// Stream the rows straight from the bitmap
+		OutputFile file;
+		saved = file.create(tempname) &&
+		        WriteTga(file, FreeImage_GetBits(bitmap), FreeImage_GetPitch(bitmap), FreeImage_GetWidth(bitmap), FreeImage_GetHeight(bitmap), compressImage) &&
+		        (!syncOnSave || file.sync());
+	}
+	else
 	{
+		saved = SaveImageFile(format, bitmap, tempname);
+	}
+
+	if (!saved || !RenameFile(tempname, filename))
+	{
+		RemoveFile(tempname);
         throw wruntime_error(LoadString(IDS_ERROR_IMAGE_SAVE));
 	}
 
+	dirty.clear();
 	modified &= ~IMAGE;
 	imageFilename = filename;
 }
 
 void FilePair::FilePairImpl::saveIndex(const std::wstring& filename)
 {
-	// Save the index file
-	HANDLE hFile = CreateFile(filename.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-	if (hFile == INVALID_HANDLE_VALUE)
+	// Build the index in memory and write it in one go
+	vector<unsigned char> buffer;
+	SerializeIndex(files, buffer);
+
+	// Write a temporary file first, so a failed save leaves the old index intact
+	wstring tempname = GetTempFilename(filename);
+	OutputFile file;
+	if (!file.create(tempname))
 	{
 		throw wruntime_error(LoadString(IDS_ERROR_FILE_CREATE));
 	}
 
-	DWORD written;
-	uint32_t count = htolel((uint32_t)files.size());
-	if (!WriteFile(hFile, &count, sizeof count, &written, NULL) || written != sizeof count)
+	bool written = file.write(&buffer[0], buffer.size()) && (!syncOnSave || file.sync());
+	file.close();
+	if (!written || !RenameFile(tempname, filename))
 	{
-        CloseHandle(hFile);
-	    throw wruntime_error(LoadString(IDS_ERROR_FILE_WRITE));
-    }
-
-    // Dump the files
-    for (map<wstring,FileInfo>::const_iterator i = files.begin(); i != files.end(); i++)
-    {
-	    const FileInfo& fi = i->second;
-
-	    FILEINFO output;
-	    output.x = htolel(fi.x);
-	    output.y = htolel(fi.y);
-	    output.w = htolel(fi.w);
-	    output.h = htolel(fi.h);
-	    output.used = fi.used;
-
-	    memset(output.name, 0, 64);
-	    WideCharToMultiByte(CP_ACP, WC_NO_BEST_FIT_CHARS, i->first.c_str(), (int)i->first.length(), output.name, 64, "_", NULL);
-
-	    if (!WriteFile(hFile, &output, sizeof output, &written, NULL) || written != sizeof output)
-	    {
-            CloseHandle(hFile);
-		    throw wruntime_error(LoadString(IDS_ERROR_FILE_WRITE));
-	    }
-    }
-    CloseHandle(hFile);
+		RemoveFile(tempname);
+		throw wruntime_error(LoadString(IDS_ERROR_FILE_WRITE));
+	}
 
-    indexFilename = filename;
-    modified &= ~INDEX;
+	indexFilename = filename;
+	modified &= ~INDEX;
 }
 
-void FilePair::FilePairImpl::saveBitmapFile(const FileInfo& fi, FIBITMAP* bitmap, const wstring& filename, FREE_IMAGE_FORMAT format)
+// Save a bitmap to a file of the given format (or determined by its name,
+// TGA if it has none). Returns false if that failed.
+static bool SaveBitmap(FIBITMAP* dib, const wstring& filename, FREE_IMAGE_FORMAT format)
 {
 	wstring name = filename;
 	if (format == FIF_UNKNOWN)
@@ -136,144 +406,1094 @@ void FilePair::FilePairImpl::saveBitmapFile(const FileInfo& fi, FIBITMAP* bitmap
 		{
 			name.append(L".TGA");
 		}
-		format = FreeImage_GetFIFFromFilenameU( name.c_str() );
+		format = GetFormatFromName( name );
 	}
 
-	FIBITMAP* dib = FreeImage_Copy(bitmap, fi.x, fi.y, fi.x + fi.w, fi.y + fi.h);
-	if (dib == NULL)
+	if (format == FIF_TARGA && FreeImage_GetBPP(dib) == 32 && FI_RGBA_RED == 2 && FI_RGBA_BLUE == 0)
 	{
-		throw wruntime_error(LoadString(IDS_ERROR_BITMAP_COPY));
+		// Write it ourselves, so extracting workers need not wait for the lock
+		OutputFile file;
+		return file.create(name) &&
+		       WriteTga(file, FreeImage_GetBits(dib), FreeImage_GetPitch(dib), FreeImage_GetWidth(dib), FreeImage_GetHeight(dib), false);
 	}
-	FreeImage_SaveU(format, dib, name.c_str(), 0 );
+	return SaveImageFile(format, dib, name);
+}
+
+void FilePair::FilePairImpl::saveBitmapFile(const FileInfo& fi, const wstring& filename, FREE_IMAGE_FORMAT format)
+{
+	FIBITMAP* dib = copyArea(fi);
+	SaveBitmap(dib, filename, format);
 	FreeImage_Unload(dib);
 }
 
-static inline unsigned long GetArea( FIBITMAP* bitmap )
+struct FilePair::FilePairImpl::ExtractJob
+{
+	const FilePairImpl*    pair;
+	const MappedFile*      file;
+	const TgaHeader*       header;
+	const vector<wstring>* filenames;
+	const vector<wstring>* targets;
+	vector<wstring>*       errors;
+	FREE_IMAGE_FORMAT      format;
+};
+
+void FilePair::FilePairImpl::ExtractWorker(size_t index, void* context)
+{
+	const ExtractJob& job = *(const ExtractJob*)context;
+	wstring& error = (*job.errors)[index];
+	try
+	{
+		FileMap::const_iterator i = job.pair->files.find( (*job.filenames)[index] );
+		if (i == job.pair->files.end())
+		{
+			error = LoadString(IDS_ERROR_FILE_OPEN);
+			return;
+		}
+
+		FIBITMAP* dib = job.pair->copyArea(i->second, *job.file, *job.header);
+		if (!SaveBitmap(dib, (*job.targets)[index], job.format))
+		{
+			error = LoadString(IDS_ERROR_IMAGE_SAVE);
+		}
+		FreeImage_Unload(dib);
+	}
+	catch (wexception& e)
+	{
+		error = e.what();
+	}
+	catch (...)
+	{
+		error = LoadString(IDS_ERROR_IMAGE_SAVE);
+	}
+}
+
+void FilePair::FilePairImpl::extractFiles( const vector<wstring>& filenames, const vector<wstring>& targets, vector<wstring>& errors, FREE_IMAGE_FORMAT format )
+{
+	// Get the image ready up front; the workers only read from it
+	MappedFile file;
+	TgaHeader  header;
+	if (!openImageFile(file, header))
+	{
+		ensureBitmap();
+	}
+
+	errors.assign(filenames.size(), wstring());
+
+	ExtractJob job = { this, &file, &header, &filenames, &targets, &errors, format };
+	ParallelFor( filenames.size(), ExtractWorker, &job );
+}
+
+// Maximum number of files moved to make room for a single new file
+static const size_t MAX_RELOCATIONS = 4;
+
+// Maximum number of places where making room is attempted for a new file
+static const size_t MAX_RELOCATION_ATTEMPTS = 16;
+
+struct RelocationCandidate
+{
+	FreeArea::RECT          window;
+	unsigned long           cost;	// Number of pixels to move
+	std::vector<FileInfo*> files;	// Files to move out of the window
+
+	bool operator < (const RelocationCandidate& c) const {
+		return cost < c.cost;
+	}
+};
+
+static inline bool Intersects(const FreeArea::RECT& r, const FileInfo& fi)
 {
-	return FreeImage_GetWidth(bitmap) * FreeImage_GetHeight(bitmap);
+	return (r.x < fi.x + fi.w + 1) && (fi.x - 1 < r.x + r.w) &&
+	       (r.y < fi.y + fi.h + 1) && (fi.y - 1 < r.y + r.h);
+}
+
+bool FilePair::FilePairImpl::PlanRelocation( FreeArea& freearea, FreeArea::Heuristic heuristic, FreeArea::RECT& area, unsigned long width, unsigned long height, vector<Relocation>& moves ) const
+{
+	// Try windows aligned to the top-left corner of existing files.
+	// Files that already have been moved in this plan stay where they are.
+	vector<RelocationCandidate> candidates;
+	for (map<wstring,FileInfo>::const_iterator i = files.begin(); i != files.end(); i++)
+	{
+		RelocationCandidate c;
+		c.window.x = i->second.x - 1;
+		c.window.y = i->second.y - 1;
+		c.window.w = area.w;
+		c.window.h = area.h;
+		c.cost     = 0;
+		if (c.window.x + c.window.w > width || c.window.y + c.window.h > height)
+		{
+			continue;
+		}
+
+		for (map<wstring,FileInfo>::const_iterator j = files.begin(); j != files.end() && c.files.size() <= MAX_RELOCATIONS; j++)
+		{
+			if (Intersects(c.window, j->second))
+			{
+				// Aliases move along with the first file of their area
+				bool alias = false;
+				for (size_t k = 0; k < c.files.size() && !alias; k++)
+				{
+					alias = (c.files[k]->x == j->second.x && c.files[k]->y == j->second.y);
+				}
+				if (!alias)
+				{
+					c.files.push_back( const_cast<FileInfo*>(&j->second) );
+					c.cost += (j->second.w + 2) * (j->second.h + 2);
+				}
+			}
+		}
+
+		bool moved = false;
+		for (size_t j = 0; j < c.files.size() && !moved; j++)
+		{
+			for (size_t k = 0; k < moves.size() && !moved; k++)
+			{
+				moved = (moves[k].fi == c.files[j]);
+			}
+		}
+
+		if (!moved && c.files.size() <= MAX_RELOCATIONS)
+		{
+			candidates.push_back(c);
+		}
+	}
+
+	// Try the cheapest ones first
+	stable_sort(candidates.begin(), candidates.end());
+	for (size_t i = 0; i < candidates.size() && i < MAX_RELOCATION_ATTEMPTS; i++)
+	{
+		const RelocationCandidate& c = candidates[i];
+
+		FreeArea trial = freearea;
+		for (size_t j = 0; j < c.files.size(); j++)
+		{
+			const FileInfo* fi = c.files[j];
+			trial.addFreeArea(fi->x - 1, fi->y - 1, fi->w + 2, fi->h + 2);
+		}
+
+		if (!trial.addUsedArea(c.window.x, c.window.y, c.window.w, c.window.h))
+		{
+			// Something else, e.g. a file placed earlier in this plan, is in the way
+			continue;
+		}
+
+		vector<Relocation> planned;
+		for (size_t j = 0; j < c.files.size(); j++)
+		{
+			FreeArea::RECT r;
+			r.w = c.files[j]->w + 2;
+			r.h = c.files[j]->h + 2;
+			if (!trial.getFreeArea( r, heuristic ))
+			{
+				break;
+			}
+			Relocation move = { c.files[j], r.x, r.y };
+			planned.push_back(move);
+		}
+
+		if (planned.size() == c.files.size())
+		{
+			// Success, commit the plan
+			freearea = trial;
+			moves.insert(moves.end(), planned.begin(), planned.end());
+			area.x = c.window.x;
+			area.y = c.window.y;
+			return true;
+		}
+	}
+	return false;
+}
+
+void FilePair::FilePairImpl::Relocate( const vector<Relocation>& moves )
+{
+	if (moves.empty())
+	{
+		return;
+	}
+	unsigned long height = FreeImage_GetHeight(bitmap);
+
+	// Where the aliases of the moved files have to go
+	set<const FileInfo*>     moved;
+	map<Position, Position> targets;
+	for (size_t i = 0; i < moves.size(); i++)
+	{
+		moved.insert(moves[i].fi);
+		targets[Position(moves[i].fi->x, moves[i].fi->y)] = Position(moves[i].x + 1, moves[i].y + 1);
+	}
+
+	// Files can move into each other's old place, so take them all out first
+	vector< vector<uint32_t> > pixels(moves.size());
+	for (size_t i = 0; i < moves.size(); i++)
+	{
+		const FileInfo& fi = *moves[i].fi;
+		pixels[i].resize( (fi.w + 2) * (fi.h + 2) );
+		markDirty( fi.x - 1, fi.y - 1, fi.w + 2, fi.h + 2 );
+		for (unsigned long y = 0; y < fi.h + 2; y++)
+		{
+			uint32_t* bits = (uint32_t*)FreeImage_GetScanLine(bitmap, height - (fi.y - 1 + y) - 1) + fi.x - 1;
+			memcpy(&pixels[i][y * (fi.w + 2)], bits, (fi.w + 2) * sizeof(uint32_t));
+			memset(bits, 0, (fi.w + 2) * sizeof(uint32_t));
+		}
+	}
+
+	for (size_t i = 0; i < moves.size(); i++)
+	{
+		FileInfo& fi = *moves[i].fi;
+		fi.x = moves[i].x + 1;
+		fi.y = moves[i].y + 1;
+		markDirty( fi.x - 1, fi.y - 1, fi.w + 2, fi.h + 2 );
+		for (unsigned long y = 0; y < fi.h + 2; y++)
+		{
+			uint32_t* bits = (uint32_t*)FreeImage_GetScanLine(bitmap, height - (fi.y - 1 + y) - 1) + fi.x - 1;
+			memcpy(bits, &pixels[i][y * (fi.w + 2)], (fi.w + 2) * sizeof(uint32_t));
+		}
+	}
+
+	for (map<wstring,FileInfo>::iterator i = files.begin(); i != files.end(); i++)
+	{
+		map<Position, Position>::const_iterator t = targets.find(Position(i->second.x, i->second.y));
+		if (t != targets.end() && moved.find(&i->second) == moved.end())
+		{
+			i->second.x = t->second.first;
+			i->second.y = t->second.second;
+		}
+	}
+}
+
+void FilePair::FilePairImpl::PlanLayout( FreeArea& freearea, FreeArea::Heuristic heuristic, vector<FreeArea::RECT>& areas, unsigned long& width, unsigned long& height, vector<Relocation>* moves, vector<size_t>& unplaced ) const
+{
+	unplaced.clear();
+	for (size_t i = 0; i < areas.size(); i++)
+	{
+		FreeArea::RECT& area = areas[i];
+		while (!freearea.getFreeArea( area, heuristic ))
+		{
+			if (moves != NULL && PlanRelocation( freearea, heuristic, area, width, height, *moves ))
+			{
+				// Made room by moving other files
+				break;
+			}
+
+			// Bitmap is full, expand (double) it, if allowed
+			bool growWidth  = (maxWidth  == 0 || width  * 2 <= maxWidth);
+			bool growHeight = (maxHeight == 0 || height * 2 <= maxHeight);
+			if (growHeight && (height < width || !growWidth))
+			{
+				freearea.addFreeArea(0, height, width, height);
+				height *= 2;
+			}
+			else if (growWidth)
+			{
+				freearea.addFreeArea(width, 0, width, height);
+				width  *= 2;
+			}
+			else
+			{
+				// Out of room
+				unplaced.push_back(i);
+				break;
+			}
+		}
+	}
+}
+
+// Get the pixel at (x,y) of a 32-bit bitmap, measured from the top.
+// Rows further down are FreeImage_GetPitch bytes lower in memory.
+static inline uint32_t* GetPixel( FIBITMAP* dib, unsigned long x, unsigned long y )
+{
+	return (uint32_t*)FreeImage_GetScanLine(dib, FreeImage_GetHeight(dib) - y - 1) + x;
+}
+
+// Copy a w by h block of pixels between two 32-bit bitmaps.
+// The coordinates are measured from the top of the bitmaps.
+static void CopyBlock( FIBITMAP* dst, unsigned long dx, unsigned long dy, FIBITMAP* src, unsigned long sx, unsigned long sy, unsigned long w, unsigned long h )
+{
+	CopyRect(GetPixel(dst, dx, dy), -(ptrdiff_t)FreeImage_GetPitch(dst), GetPixel(src, sx, sy), -(ptrdiff_t)FreeImage_GetPitch(src), w, h);
+}
+
+// Clear a w by h block of pixels of a 32-bit bitmap.
+// The coordinates are measured from the top of the bitmap.
+static void ClearBlock( FIBITMAP* dst, unsigned long x, unsigned long y, unsigned long w, unsigned long h )
+{
+	FillRect(GetPixel(dst, x, y), -(ptrdiff_t)FreeImage_GetPitch(dst), 0, w, h);
+}
+
+// Hash the pixels of a w by h block of a 32-bit bitmap, measured from the top
+static uint64_t HashBlock( FIBITMAP* dib, unsigned long x, unsigned long y, unsigned long w, unsigned long h )
+{
+	uint64_t hash = 0;
+	for (unsigned long row = 0; row < h; row++)
+	{
+		hash = (hash ^ HashBytes(GetPixel(dib, x, y + row), w * sizeof(uint32_t))) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+// Are two w by h blocks of 32-bit bitmaps identical?
+static bool SameBlock( FIBITMAP* dib1, unsigned long x1, unsigned long y1, FIBITMAP* dib2, unsigned long x2, unsigned long y2, unsigned long w, unsigned long h )
+{
+	for (unsigned long row = 0; row < h; row++)
+	{
+		if (memcmp(GetPixel(dib1, x1, y1 + row), GetPixel(dib2, x2, y2 + row), w * sizeof(uint32_t)) != 0)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// What identical files have in common: the size and hash of their pixels
+struct ContentKey
+{
+	unsigned long w, h;
+	uint64_t      hash;
+
+	bool operator < (const ContentKey& k) const {
+		return (w != k.w) ? w < k.w : (h != k.h) ? h < k.h : hash < k.hash;
+	}
+};
+
+// A file that others are compared with to find duplicates
+struct DuplicateCandidate
+{
+	FIBITMAP*     dib;
+	unsigned long x, y;		// Top-left pixel of the file in dib
+	wstring       name;		// Index name of the file
+};
+
+struct FilePair::FilePairImpl::HashJob
+{
+	FIBITMAP*               bitmap;
+	vector<const FileInfo*> files;
+	vector<uint64_t>        hashes;
+};
+
+void FilePair::FilePairImpl::HashWorker(size_t index, void* context)
+{
+	HashJob& job = *(HashJob*)context;
+	const FileInfo& fi = *job.files[index];
+	job.hashes[index] = HashBlock(job.bitmap, fi.x, fi.y, fi.w, fi.h);
+}
+
+void FilePair::FilePairImpl::releaseAreas( const vector<FileInfo>& removed, vector<FreeArea::RECT>& released )
+{
+	if (removed.empty())
+	{
+		return;
+	}
+
+	set<Position> inUse;
+	for (map<wstring,FileInfo>::const_iterator i = files.begin(); i != files.end(); i++)
+	{
+		inUse.insert( Position(i->second.x, i->second.y) );
+	}
+
+	for (size_t i = 0; i < removed.size(); i++)
+	{
+		// This also frees an area only once if several of its aliases went
+		const FileInfo& fi = removed[i];
+		if (inUse.insert( Position(fi.x, fi.y) ).second)
+		{
+			FreeArea::RECT area = { fi.x - 1, fi.y - 1, fi.w + 2, fi.h + 2 };
+			ClearBlock(bitmap, area.x, area.y, area.w, area.h);
+			markDirty( area.x, area.y, area.w, area.h );
+			released.push_back(area);
+		}
+	}
+}
+
+static bool CompareAreaDesc( const FileInfo* fi1, const FileInfo* fi2 )
+{
+	return fi1->w * fi1->h > fi2->w * fi2->h;
+}
+
+void FilePair::FilePairImpl::repack( FreeArea::Heuristic heuristic )
+{
+	if (readOnly || files.empty())
+	{
+		return;
+	}
+	ensureBitmap();
+
+	// Place the files by descending area, starting from the smallest
+	// power-of-two image that could possibly hold them all. Aliases are
+	// not placed themselves, but follow the first file of their area.
+	vector<FileInfo*> entries;
+	vector< pair<FileInfo*, const FileInfo*> > aliases;
+	map<Position, FileInfo*> positions;
+	for (map<wstring,FileInfo>::iterator i = files.begin(); i != files.end(); i++)
+	{
+		pair<map<Position, FileInfo*>::iterator, bool> p = positions.insert( make_pair(Position(i->second.x, i->second.y), &i->second) );
+		if (p.second)
+		{
+			entries.push_back( &i->second );
+		}
+		else
+		{
+			aliases.push_back( make_pair(&i->second, p.first->second) );
+		}
+	}
+	stable_sort(entries.begin(), entries.end(), CompareAreaDesc);
+
+	vector<FreeArea::RECT> areas(entries.size());
+	unsigned long long total = 0;
+	unsigned long widest = 0, tallest = 0;
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		areas[i].w = entries[i]->w + 2;
+		areas[i].h = entries[i]->h + 2;
+		total     += (unsigned long long)areas[i].w * areas[i].h;
+		widest     = max(widest,  areas[i].w);
+		tallest    = max(tallest, areas[i].h);
+	}
+
+	// Grow the way PlanLayout does, so the start stays within the maximum
+	// size; if the files cannot fit in that, PlanLayout reports it
+	unsigned long newWidth = 1, newHeight = 1;
+	while (newWidth  < widest  && (maxWidth  == 0 || newWidth  * 2 <= maxWidth))  newWidth  *= 2;
+	while (newHeight < tallest && (maxHeight == 0 || newHeight * 2 <= maxHeight)) newHeight *= 2;
+	while ((unsigned long long)newWidth * newHeight < total)
+	{
+		bool growWidth  = (maxWidth  == 0 || newWidth  * 2 <= maxWidth);
+		bool growHeight = (maxHeight == 0 || newHeight * 2 <= maxHeight);
+		if (growHeight && (newHeight < newWidth || !growWidth)) newHeight *= 2;
+		else if (growWidth)                                     newWidth  *= 2;
+		else                                                    break;
+	}
+
+	FreeArea plan;
+	vector<size_t> unplaced;
+	plan.addFreeArea(0, 0, newWidth, newHeight);
+	PlanLayout( plan, heuristic, areas, newWidth, newHeight, NULL, unplaced );
+	if (!unplaced.empty())
+	{
+		throw wruntime_error(LoadString(IDS_ERROR_IMAGE_FULL));
+	}
+
+	FIBITMAP* newBitmap = FreeImage_Allocate(newWidth, newHeight, 32);
+	if (newBitmap == NULL)
+	{
+		throw wruntime_error(LoadString(IDS_ERROR_BITMAP_CREATE));
+	}
+
+	// Move the pixels, including the border, and update the index
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		FileInfo& fi = *entries[i];
+		CopyBlock(newBitmap, areas[i].x, areas[i].y, bitmap, fi.x - 1, fi.y - 1, areas[i].w, areas[i].h);
+		fi.x = areas[i].x + 1;
+		fi.y = areas[i].y + 1;
+	}
+	for (size_t i = 0; i < aliases.size(); i++)
+	{
+		aliases[i].first->x = aliases[i].second->x;
+		aliases[i].first->y = aliases[i].second->y;
+	}
+
+	FreeImage_Unload(bitmap);
+	bitmap   = newBitmap;
+	freearea = plan;
+	markDirty( 0, 0, newWidth, newHeight );
+	modified = IMAGE | INDEX;
+}
+
+size_t FilePair::FilePairImpl::mergeDuplicates()
+{
+	if (readOnly || files.empty())
+	{
+		return 0;
+	}
+	ensureBitmap();
+
+	// The entries of every area, and how many areas there are of every size
+	map<Position, vector<FileInfo*> > users;
+	map<pair<unsigned long, unsigned long>, unsigned int> sizes;
+	for (map<wstring,FileInfo>::iterator i = files.begin(); i != files.end(); i++)
+	{
+		vector<FileInfo*>& entries = users[Position(i->second.x, i->second.y)];
+		if (entries.empty())
+		{
+			sizes[make_pair(i->second.w, i->second.h)]++;
+		}
+		entries.push_back(&i->second);
+	}
+
+	// Only areas of a size that occurs more than once need to be hashed
+	HashJob job;
+	job.bitmap = bitmap;
+	for (map<Position, vector<FileInfo*> >::const_iterator i = users.begin(); i != users.end(); i++)
+	{
+		const FileInfo* fi = i->second.front();
+		if (sizes[make_pair(fi->w, fi->h)] > 1)
+		{
+			job.files.push_back(fi);
+		}
+	}
+	job.hashes.resize(job.files.size());
+	ParallelFor( job.files.size(), HashWorker, &job );
+
+	// The first area with some contents is kept; identical ones are freed
+	// and their entries moved onto it
+	multimap<ContentKey, const FileInfo*> kept;
+	vector<FreeArea::RECT> released;
+	size_t merged = 0;
+	for (size_t i = 0; i < job.files.size(); i++)
+	{
+		FileInfo area = *job.files[i];
+		ContentKey key = { area.w, area.h, job.hashes[i] };
+
+		const FileInfo* original = NULL;
+		typedef multimap<ContentKey, const FileInfo*>::const_iterator Iterator;
+		pair<Iterator, Iterator> range = kept.equal_range(key);
+		for (Iterator k = range.first; k != range.second && original == NULL; k++)
+		{
+			if (SameBlock(bitmap, k->second->x, k->second->y, bitmap, area.x, area.y, area.w, area.h))
+			{
+				original = k->second;
+			}
+		}
+
+		if (original == NULL)
+		{
+			kept.insert( make_pair(key, job.files[i]) );
+			continue;
+		}
+
+		vector<FileInfo*>& entries = users[Position(area.x, area.y)];
+		for (size_t j = 0; j < entries.size(); j++)
+		{
+			entries[j]->x = original->x;
+			entries[j]->y = original->y;
+		}
+		merged += entries.size();
+
+		FreeArea::RECT r = { area.x - 1, area.y - 1, area.w + 2, area.h + 2 };
+		ClearBlock(bitmap, r.x, r.y, r.w, r.h);
+		markDirty( r.x, r.y, r.w, r.h );
+		released.push_back(r);
+	}
+
+	if (!released.empty())
+	{
+		freearea.addFreeAreas(released);
+		modified = IMAGE | INDEX;
+	}
+	return merged;
+}
+
+// Image file in a format we decode ourselves (24 or 32-bit TGA or BMP),
+// straight into 32-bit rows
+class NativeImage
+{
+	MappedFile m_file;
+	bool       m_tga;
+	TgaHeader  m_tgaHeader;
+	BmpHeader  m_bmpHeader;
+
+public:
+	unsigned long width, height;
+
+	// Returns false if the file is not in one of those formats
+	bool open( const wstring& filename )
+	{
+		if (FI_RGBA_RED != 2 || FI_RGBA_BLUE != 0 || !m_file.open(filename))
+		{
+			// Our rows would not match FreeImage's pixel layout
+			return false;
+		}
+
+		if (ReadBmpHeader(m_file.data(), m_file.size(), m_bmpHeader))
+		{
+			m_tga  = false;
+			width  = m_bmpHeader.width;
+			height = m_bmpHeader.height;
+			return true;
+		}
+
+		if (ReadTgaHeader(m_file.data(), m_file.size(), m_tgaHeader))
+		{
+			m_tga  = true;
+			width  = m_tgaHeader.width;
+			height = m_tgaHeader.height;
+			return true;
+		}
+		return false;
+	}
+
+	// Is all of the pixel data there? If it is, decode cannot fail.
+	bool complete() const
+	{
+		return m_tga ? CheckTgaData(m_file.data(), m_file.size(), m_tgaHeader)
+		             : CheckBmpData(m_file.size(), m_bmpHeader);
+	}
+
+	// Decode into bits (bottom row first, pitch bytes apart), filling the
+	// 1px border around them as well if asked to.
+	// Returns false if the file is damaged.
+	bool decode( unsigned char* bits, size_t pitch, bool border = false ) const
+	{
+		return m_tga ? DecodeTga(m_file.data(), m_file.size(), m_tgaHeader, bits, pitch, border)
+		             : DecodeBmp(m_file.data(), m_file.size(), m_bmpHeader, bits, pitch, border);
+	}
+};
+
+// Decode a file that NativeImage handles into a new 32-bit bitmap.
+// Returns NULL if the file is not one we can decode ourselves.
+static FIBITMAP* ReadNativeFile( const wstring& filename )
+{
+	NativeImage image;
+	if (!image.open(filename))
+	{
+		return NULL;
+	}
+
+	FIBITMAP* dib = FreeImage_Allocate(image.width, image.height, 32);
+	if (dib == NULL)
+	{
+		throw wruntime_error(LoadString(IDS_ERROR_IMAGE_LOAD));
+	}
+
+	if (!image.decode(FreeImage_GetBits(dib), FreeImage_GetPitch(dib)))
+	{
+		FreeImage_Unload(dib);
+		throw wruntime_error(LoadString(IDS_ERROR_IMAGE_LOAD));
+	}
+	return dib;
+}
+
+// Get the size of an image without decoding the pixels.
+// Returns false if the format does not allow that.
+static bool ReadImageSize( const wstring& filename, unsigned long& width, unsigned long& height )
+{
+	{
+		NativeImage image;
+		if (image.open(filename))
+		{
+			width  = image.width;
+			height = image.height;
+			return true;
+		}
+	}
+
+	FREE_IMAGE_FORMAT fif = GetFormatFromFile(filename);
+	if (fif != FIF_UNKNOWN && FreeImage_FIFSupportsNoPixels(fif))
+	{
+		FIBITMAP* dib = LoadImageFile(fif, filename, FIF_LOAD_NOPIXELS);
+		if (dib != NULL)
+		{
+			width  = FreeImage_GetWidth(dib);
+			height = FreeImage_GetHeight(dib);
+			FreeImage_Unload(dib);
+			return true;
+		}
+	}
+	return false;
+}
+
+static inline unsigned long GetArea( const FreeArea::RECT& area )
+{
+	return area.w * area.h;
 }
 
 // When we insert a large batch of files, sort them by descending area. This way,
 // allocation of free rectangles will be more efficient.
-static void QuickSortAreaDesc( vector<wstring>& filenames, vector<FIBITMAP*>& bitmaps, int start, int end)
+static void QuickSortAreaDesc( vector<wstring>& filenames, vector<FIBITMAP*>& bitmaps, vector<FreeArea::RECT>& areas, int start, int end)
 {
-	unsigned long pivot = GetArea(bitmaps[(start + end) / 2]);
+	unsigned long pivot = GetArea(areas[(start + end) / 2]);
 	int k = start, m = end;
 	do
 	{
-		while (GetArea(bitmaps[k]) > pivot) k++;
-		while (GetArea(bitmaps[m]) < pivot) m--;
+		while (GetArea(areas[k]) > pivot) k++;
+		while (GetArea(areas[m]) < pivot) m--;
 		if (k <= m)
 		{
 			swap(filenames[k], filenames[m]);
+			swap(areas[k], areas[m]);
 			swap(bitmaps[k++], bitmaps[m--]);
 		}
 	} while (k <= m);
-	if (start < m) QuickSortAreaDesc(filenames, bitmaps, start, m);
-	if (k < end)   QuickSortAreaDesc(filenames, bitmaps, k, end);
+	if (start < m) QuickSortAreaDesc(filenames, bitmaps, areas, start, m);
+	if (k < end)   QuickSortAreaDesc(filenames, bitmaps, areas, k, end);
+}
+
+struct FilePair::FilePairImpl::ReadJob
+{
+	const vector<wstring>*  filenames;
+	vector<FIBITMAP*>*      bitmaps;
+	vector<FreeArea::RECT>* areas;		// Sizes of the files
+	vector<uint64_t>*       hashes;		// Hashes of the pixels, or NULL if not needed
+	vector<wstring>*        errors;
+};
+
+void FilePair::FilePairImpl::ReadWorker(size_t index, void* context)
+{
+	const ReadJob& job = *(const ReadJob*)context;
+	FreeArea::RECT& area = (*job.areas)[index];
+	try
+	{
+		if (job.hashes == NULL)
+		{
+			NativeImage image;
+			if (image.open( (*job.filenames)[index] ))
+			{
+				// Only get the size; PasteWorker decodes it straight into the
+				// image. Check the data now, before the image is changed.
+				if (!image.complete())
+				{
+					throw wruntime_error(LoadString(IDS_ERROR_IMAGE_LOAD));
+				}
+				area.w = image.width;
+				area.h = image.height;
+				return;
+			}
+		}
+
+		FIBITMAP* dib = ReadBitmapFile( (*job.filenames)[index] );
+		(*job.bitmaps)[index] = dib;
+		area.w = FreeImage_GetWidth(dib);
+		area.h = FreeImage_GetHeight(dib);
+		if (job.hashes != NULL)
+		{
+			(*job.hashes)[index] = HashBlock(dib, 0, 0, FreeImage_GetWidth(dib), FreeImage_GetHeight(dib));
+		}
+	}
+	catch (wexception& e)
+	{
+		(*job.errors)[index] = e.what();
+	}
+	catch (...)
+	{
+		(*job.errors)[index] = LoadString(IDS_ERROR_IMAGE_LOAD);
+	}
+}
+
+struct FilePair::FilePairImpl::PasteJob
+{
+	FIBITMAP*                     bitmap;
+	const vector<wstring>*        filenames;
+	const vector<FIBITMAP*>*      bitmaps;	// Files decoded up front, or NULL
+	const vector<FreeArea::RECT>* areas;	// Where they go, border included
+	vector<wstring>*              errors;
+};
+
+void FilePair::FilePairImpl::PasteWorker(size_t index, void* context)
+{
+	const PasteJob&       job  = *(const PasteJob*)context;
+	const FreeArea::RECT& area = (*job.areas)[index];
+	unsigned long x = area.x + 1, y = area.y + 1, w = area.w - 2, h = area.h - 2;
+	try
+	{
+		unsigned long pitch = FreeImage_GetPitch(job.bitmap);
+		FIBITMAP*     dib   = (*job.bitmaps)[index];
+		if (dib == NULL)
+		{
+			NativeImage image;
+			if (image.open( (*job.filenames)[index] ))
+			{
+				// Decode straight into the image, border and all
+				if (image.width != w || image.height != h)
+				{
+					// The file changed since its size was read
+					throw wruntime_error(LoadString(IDS_ERROR_IMAGE_LOAD));
+				}
+				unsigned char* bits = FreeImage_GetScanLine(job.bitmap, FreeImage_GetHeight(job.bitmap) - y - h) + x * sizeof(uint32_t);
+				if (!image.decode(bits, pitch, true))
+				{
+					throw wruntime_error(LoadString(IDS_ERROR_IMAGE_LOAD));
+				}
+				return;
+			}
+
+			// Left for now to save memory
+			dib = ReadBitmapFile( (*job.filenames)[index] );
+			if (FreeImage_GetWidth(dib) != w || FreeImage_GetHeight(dib) != h)
+			{
+				FreeImage_Unload(dib);
+				throw wruntime_error(LoadString(IDS_ERROR_IMAGE_LOAD));
+			}
+			CopyBlock(job.bitmap, x, y, dib, 0, 0, w, h);
+			FreeImage_Unload(dib);
+		}
+		else
+		{
+			CopyBlock(job.bitmap, x, y, dib, 0, 0, w, h);
+		}
+		ReplicateBorder(GetPixel(job.bitmap, x, y), -(ptrdiff_t)pitch, w, h);
+	}
+	catch (wexception& e)
+	{
+		(*job.errors)[index] = e.what();
+	}
+	catch (...)
+	{
+		(*job.errors)[index] = LoadString(IDS_ERROR_IMAGE_LOAD);
+	}
+
+	if (!(*job.errors)[index].empty())
+	{
+		// Leave the area empty, as free space is
+		ClearBlock(job.bitmap, area.x, area.y, area.w, area.h);
+	}
 }
 
-void FilePair::FilePairImpl::insertFiles( vector<wstring>& filenames )
+void FilePair::FilePairImpl::findDuplicates( vector<wstring>& filenames, vector<FIBITMAP*>& bitmaps, vector<FreeArea::RECT>& areas, const vector<uint64_t>& hashes, vector< pair<wstring, wstring> >& aliases ) const
+{
+	// Files in the index that this batch replaces cannot be shared
+	set<wstring> names;
+	set< pair<unsigned long, unsigned long> > sizes;
+	for (size_t i = 0; i < filenames.size(); i++)
+	{
+		names.insert( GetIndexName(filenames[i]) );
+		sizes.insert( make_pair(areas[i].w, areas[i].h) );
+	}
+
+	// Hash the areas in the index that have the size of an inserted file
+	HashJob job;
+	job.bitmap = bitmap;
+	vector<wstring> owners;
+	set<Position> hashed;
+	for (map<wstring,FileInfo>::const_iterator i = files.begin(); i != files.end(); i++)
+	{
+		const FileInfo& fi = i->second;
+		if (names.find(i->first) == names.end() && sizes.find(make_pair(fi.w, fi.h)) != sizes.end() &&
+			hashed.insert( Position(fi.x, fi.y) ).second)
+		{
+			job.files.push_back(&fi);
+			owners.push_back(i->first);
+		}
+	}
+	job.hashes.resize(job.files.size());
+	ParallelFor( job.files.size(), HashWorker, &job );
+
+	multimap<ContentKey, DuplicateCandidate> candidates;
+	for (size_t i = 0; i < job.files.size(); i++)
+	{
+		const FileInfo& fi = *job.files[i];
+		ContentKey key = { fi.w, fi.h, job.hashes[i] };
+		DuplicateCandidate c = { bitmap, fi.x, fi.y, owners[i] };
+		candidates.insert( make_pair(key, c) );
+	}
+
+	// Keep the files that are new, in order, and take out the rest
+	size_t count = 0;
+	for (size_t i = 0; i < filenames.size(); i++)
+	{
+		ContentKey key = { areas[i].w, areas[i].h, hashes[i] };
+		wstring name = GetIndexName(filenames[i]);
+
+		const DuplicateCandidate* original = NULL;
+		typedef multimap<ContentKey, DuplicateCandidate>::const_iterator Iterator;
+		pair<Iterator, Iterator> range = candidates.equal_range(key);
+		for (Iterator k = range.first; k != range.second && original == NULL; k++)
+		{
+			if (SameBlock(k->second.dib, k->second.x, k->second.y, bitmaps[i], 0, 0, areas[i].w, areas[i].h))
+			{
+				original = &k->second;
+			}
+		}
+
+		if (original != NULL)
+		{
+			aliases.push_back( make_pair(filenames[i], original->name) );
+			FreeImage_Unload(bitmaps[i]);
+			continue;
+		}
+
+		DuplicateCandidate c = { bitmaps[i], 0, 0, name };
+		candidates.insert( make_pair(key, c) );
+		filenames[count] = filenames[i];
+		bitmaps[count]   = bitmaps[i];
+		areas[count]     = areas[i];
+		count++;
+	}
+	filenames.resize(count);
+	bitmaps.resize(count);
+	areas.resize(count);
+}
+
+void FilePair::FilePairImpl::insertFiles( vector<wstring>& filenames, vector<wstring>* overflow )
 {
 	if (readOnly)
 	{
 		return;
 	}
+	ensureBitmap();
 
 	vector<FIBITMAP*> bitmaps;
 
 	try
 	{
-		// Read the files
 		size_t i;
-		for (i = 0; i < filenames.size(); i++)
+		vector<FreeArea::RECT> areas(filenames.size());
+
+		// Duplicates of other files, and the index name of the file whose area they share
+		vector< pair<wstring, wstring> > aliases;
+		bitmaps.resize(filenames.size(), NULL);
+		if (lowMemory)
+		{
+			// Only get the sizes now; every file is decoded right before it is
+			// pasted. The files we decode ourselves are checked now, so that
+			// cannot fail once the image has been changed.
+			for (i = 0; i < filenames.size(); i++)
+			{
+				NativeImage image;
+				if (image.open( filenames[i] ))
+				{
+					if (!image.complete())
+					{
+						throw wruntime_error(LoadString(IDS_ERROR_IMAGE_LOAD));
+					}
+					areas[i].w = image.width;
+					areas[i].h = image.height;
+				}
+				else if (!ReadImageSize( filenames[i], areas[i].w, areas[i].h ))
+				{
+					FIBITMAP* dib = ReadBitmapFile( filenames[i] );
+					areas[i].w = FreeImage_GetWidth(dib);
+					areas[i].h = FreeImage_GetHeight(dib);
+					FreeImage_Unload(dib);
+				}
+			}
+		}
+		else
 		{
-			FIBITMAP* dib = ReadBitmapFile( filenames[i] );
-			bitmaps.push_back( dib );
+			// Read the files, on all cores. Every file has its own slot, so the
+			// order does not depend on which decode finishes first. Of the files
+			// we decode ourselves only the size is read, unless the pixels are
+			// needed to find duplicates; they are decoded into the image later.
+			vector<wstring>  errors(filenames.size());
+			vector<uint64_t> hashes(mergeOnInsert ? filenames.size() : 0);
+			ReadJob job = { &filenames, &bitmaps, &areas, mergeOnInsert ? &hashes : NULL, &errors };
+			ParallelFor( filenames.size(), ReadWorker, &job );
+
+			for (i = 0; i < errors.size(); i++)
+			{
+				if (!errors[i].empty())
+				{
+					throw wruntime_error(errors[i]);
+				}
+			}
+
+			if (mergeOnInsert)
+			{
+				findDuplicates( filenames, bitmaps, areas, hashes, aliases );
+			}
 		}
 
 		// Sort them by area, descending
-		QuickSortAreaDesc( filenames, bitmaps, 0, (int)filenames.size() - 1);
+		if (filenames.size() > 1)
+		{
+			QuickSortAreaDesc( filenames, bitmaps, areas, 0, (int)filenames.size() - 1);
+		}
 
-		vector<FreeArea::RECT> areas;
+		// Plan the placement of all images first; each image has a 1px border around it
+		for (i = 0; i < areas.size(); i++)
+		{
+			areas[i].w += 2;
+			areas[i].h += 2;
+		}
 
-		// Allocate space
-		FIBITMAP*     newBitmap = NULL;
-		unsigned long newWidth  = FreeImage_GetWidth(bitmap);
-		unsigned long newHeight = FreeImage_GetHeight(bitmap);
+		FreeArea           plan      = freearea;
+		vector<Relocation> moves;
+		vector<size_t>     unplaced;
+		unsigned long      newWidth  = FreeImage_GetWidth(bitmap);
+		unsigned long      newHeight = FreeImage_GetHeight(bitmap);
+		PlanLayout( plan, heuristic, areas, newWidth, newHeight, compaction ? &moves : NULL, unplaced );
 
-		FreeArea backup = freearea;
-		for (i = 0; i < bitmaps.size(); i++)
+		if (!unplaced.empty())
 		{
-			FreeArea::RECT area;
+			if (overflow == NULL)
+			{
+				throw wruntime_error(LoadString(IDS_ERROR_IMAGE_FULL));
+			}
 
-			// Each image has a 1px border around it
-			area.w = FreeImage_GetWidth(  bitmaps[i] ) + 2;
-			area.h = FreeImage_GetHeight( bitmaps[i] ) + 2;
-			while (!freearea.getFreeArea( area ))
+			// Hand the files that did not fit back to the caller
+			set<wstring> rejected;
+			for (size_t j = unplaced.size(); j > 0; j--)
 			{
-				// Bitmap is full, expand (double) it
-				if (newBitmap == NULL)
+				size_t k = unplaced[j - 1];
+				rejected.insert( GetIndexName(filenames[k]) );
+				overflow->push_back( filenames[k] );
+				if (bitmaps[k] != NULL)
 				{
-					FreeImage_Unload( newBitmap );
-				}
-
-				if (newHeight < newWidth)
-				{
-					freearea.addFreeArea(0, newHeight, newWidth, newHeight);
-					newHeight *= 2;
-				}
-				else
-				{
-					freearea.addFreeArea(newWidth, 0, newWidth, newHeight);
-					newWidth  *= 2;
+					FreeImage_Unload( bitmaps[k] );
 				}
+				filenames.erase( filenames.begin() + k );
+				bitmaps.erase( bitmaps.begin() + k );
+				areas.erase( areas.begin() + k );
+			}
 
-				newBitmap = FreeImage_Allocate(newWidth, newHeight, 32);
-				if (newBitmap == NULL)
+			// Their duplicates go along with them
+			for (size_t j = aliases.size(); j > 0; j--)
+			{
+				if (rejected.find(aliases[j - 1].second) != rejected.end())
 				{
-					freearea = backup;
-					throw wruntime_error(LoadString(IDS_ERROR_BITMAP_EXPAND));
+					overflow->push_back( aliases[j - 1].first );
+					aliases.erase( aliases.begin() + j - 1 );
 				}
 			}
-			areas.push_back(area);
 		}
 
-		if (newBitmap != NULL)
+		if (newWidth != FreeImage_GetWidth(bitmap) || newHeight != FreeImage_GetHeight(bitmap))
 		{
-			// The bitmap has been expanded, copy old contents into new
+			// The bitmap has to be expanded; do it once, to its final size
+			FIBITMAP* newBitmap = FreeImage_Allocate(newWidth, newHeight, 32);
+			if (newBitmap == NULL)
+			{
+				throw wruntime_error(LoadString(IDS_ERROR_BITMAP_EXPAND));
+			}
+
+			// Copy old contents into new
 			FreeImage_Paste(newBitmap, bitmap, 0, 0, 255 );
 			FreeImage_Unload(bitmap);
 			bitmap = newBitmap;
 		}
+		freearea = plan;
+
+		// Move files out of the way where planned
+		Relocate(moves);
+
+		// Draw the files, on all cores: their areas do not overlap. In low
+		// memory mode, one at a time, as files may be decoded only now.
+		vector<wstring> errors(filenames.size());
+		PasteJob job = { bitmap, &filenames, &bitmaps, &areas, &errors };
+		if (lowMemory)
+		{
+			for (i = 0; i < filenames.size(); i++)
+			{
+				PasteWorker(i, &job);
+			}
+		}
+		else
+		{
+			ParallelFor( filenames.size(), PasteWorker, &job );
+		}
 
-		unsigned long pitch  = FreeImage_GetPitch(bitmap);
-		unsigned long height = FreeImage_GetHeight(bitmap);
+		// Replaced files, whose areas are freed together once the copying is done
+		vector<FileInfo>       replaced;
+		vector<FreeArea::RECT> released;
 
-		// Copy data
-		for (i = 0; i < bitmaps.size(); i++)
+		wstring error;
+		for (i = 0; i < filenames.size(); i++)
 		{
-			wstring filename = filenames[i];
-			size_t ofs = filename.find_last_of('\\');
-			if (ofs != wstring::npos)
+			if (!errors[i].empty())
 			{
-				filename = filename.substr(ofs + 1);
+				// Give back the space that was planned for it
+				released.push_back(areas[i]);
+				if (error.empty())
+				{
+					error = errors[i];
+				}
+				continue;
 			}
-			filename = filename.substr(0,63);
-			transform(filename.begin(), filename.end(), filename.begin(), toupper );
+
+			wstring filename = GetIndexName(filenames[i]);
 
 			// Check if this file already existed
 			map<wstring,FileInfo>::iterator j = files.find(filename);
 			if (j != files.end())
 			{
-				// Yes, release area in the bitmap
-				FIBITMAP* dib = FreeImage_Allocate(j->second.w + 2, j->second.h + 2, 32);
-				if (dib != NULL)
-				{
-					FreeImage_Paste(bitmap, dib, j->second.x - 1, j->second.y - 1, 255 );
-					FreeImage_Unload(dib);
-				}
-				freearea.addFreeArea( j->second.x - 1, j->second.y - 1, j->second.w + 2, j->second.h + 2 );
+				// Yes, release its area afterwards
+				replaced.push_back(j->second);
 				files.erase(j);
 			}
 
@@ -283,61 +1503,241 @@ void FilePair::FilePairImpl::insertFiles( vector<wstring>& filenames )
 			fi.y    = areas[i].y + 1;
 			fi.w    = areas[i].w - 2;
 			fi.h    = areas[i].h - 2;
+			markDirty( areas[i].x, areas[i].y, areas[i].w, areas[i].h );
+
+			// Insert file in the index
+			files.insert( make_pair(filename, fi) );
+		}
 
-			// Copy the image in the bitmap
-			FreeImage_Paste(bitmap, bitmaps[i], fi.x, fi.y, 255 );
+		if (!error.empty())
+		{
+			// Keep the files that could be read; the duplicates are left out
+			releaseAreas(replaced, released);
+			freearea.addFreeAreas(released);
+			modified = IMAGE | INDEX;
+			throw wruntime_error(error);
+		}
 
-			// Copy the border
-			uint32_t* start = (uint32_t*)FreeImage_GetScanLine(bitmap, height - fi.y - 1) + fi.x;
-			uint32_t* bits  = start;
-			for (unsigned int y = 0; y < fi.h; y++)
+		// Give the duplicates the area of their original. They count as
+		// inserted, so they are put back in filenames.
+		for (i = 0; i < aliases.size(); i++)
+		{
+			wstring filename = GetIndexName(aliases[i].first);
+			map<wstring,FileInfo>::const_iterator original = files.find(aliases[i].second);
+			if (original != files.end() && original->first != filename)
 			{
-				*(bits - 1)    = *(bits + 0);
-				*(bits + fi.w) = *(bits + fi.w - 1);
-				bits = (uint32_t*)((char*)bits - pitch);
+				FileInfo fi = original->second;
+				map<wstring,FileInfo>::iterator j = files.find(filename);
+				if (j != files.end())
+				{
+					replaced.push_back(j->second);
+					files.erase(j);
+				}
+				files.insert( make_pair(filename, fi) );
 			}
-
-			memcpy( (char*)(start - 1) + pitch, start - 1, (fi.w + 2) * sizeof(uint32_t) );
-			memcpy( bits - 1,  (char*)(bits - 1) + pitch,  (fi.w + 2) * sizeof(uint32_t) );
-			
-			// Insert file in the index
-			files.insert( make_pair(filename, fi) );
+			filenames.push_back(aliases[i].first);
 		}
+		releaseAreas(replaced, released);
+		freearea.addFreeAreas(released);
 
 		// Cleanup bitmaps
 		for (size_t j = 0; j < bitmaps.size(); j++)
 		{
-			FreeImage_Unload(bitmaps[j]);
+			if (bitmaps[j] != NULL)
+			{
+				FreeImage_Unload(bitmaps[j]);
+			}
 		}
 
 		modified = IMAGE | INDEX;
 	}
 	catch (wexception&)
 	{
-		// Cleanup bitmaps
+		// Cleanup bitmaps; files after a failed one may not have been read
 		for (size_t j = 0; j < bitmaps.size(); j++)
 		{
-			FreeImage_Unload(bitmaps[j]);
+			if (bitmaps[j] != NULL)
+			{
+				FreeImage_Unload(bitmaps[j]);
+			}
 		}
 		throw;
 	}
 }
 
-FIBITMAP* FilePair::FilePairImpl::ReadBitmapFile( const wstring& filename )
+struct FilePair::FilePairImpl::UpdateJob
 {
-	// Determine file format
-	FREE_IMAGE_FORMAT fif = FreeImage_GetFileTypeU(filename.c_str(), 0);
-	if (fif == FIF_UNKNOWN)
+	FIBITMAP*               bitmap;
+	const vector<wstring>*  filenames;
+	const vector<FileInfo>* areas;
+	vector<wstring>*        errors;
+};
+
+void FilePair::FilePairImpl::UpdateWorker(size_t index, void* context)
+{
+	const UpdateJob& job = *(const UpdateJob*)context;
+	const wstring&   filename = (*job.filenames)[index];
+	const FileInfo&  fi = (*job.areas)[index];
+	try
+	{
+		unsigned long pitch  = FreeImage_GetPitch(job.bitmap);
+		unsigned long height = FreeImage_GetHeight(job.bitmap);
+
+		NativeImage image;
+		if (image.open( filename ))
+		{
+			// Decode straight into the area of the file, border and all
+			unsigned char* bits = FreeImage_GetScanLine(job.bitmap, height - fi.y - fi.h) + fi.x * sizeof(uint32_t);
+			if (image.width != fi.w || image.height != fi.h || !image.decode(bits, pitch, true))
+			{
+				throw wruntime_error(LoadString(IDS_ERROR_IMAGE_LOAD));
+			}
+		}
+		else
+		{
+			FIBITMAP* dib = ReadBitmapFile( filename );
+			if (FreeImage_GetWidth(dib) != fi.w || FreeImage_GetHeight(dib) != fi.h)
+			{
+				FreeImage_Unload(dib);
+				throw wruntime_error(LoadString(IDS_ERROR_IMAGE_LOAD));
+			}
+			CopyBlock(job.bitmap, fi.x, fi.y, dib, 0, 0, fi.w, fi.h);
+			FreeImage_Unload(dib);
+			ReplicateBorder(GetPixel(job.bitmap, fi.x, fi.y), -(ptrdiff_t)pitch, fi.w, fi.h);
+		}
+	}
+	catch (wexception& e)
+	{
+		(*job.errors)[index] = e.what();
+	}
+	catch (...)
+	{
+		(*job.errors)[index] = LoadString(IDS_ERROR_IMAGE_LOAD);
+	}
+}
+
+void FilePair::FilePairImpl::updateFiles( vector<wstring>& filenames )
+{
+	if (readOnly)
+	{
+		return;
+	}
+	ensureBitmap();
+
+	// Areas shared by aliases cannot be redrawn for one of them
+	map<Position, unsigned int> users;
+	for (map<wstring,FileInfo>::const_iterator i = files.begin(); i != files.end(); i++)
+	{
+		users[Position(i->second.x, i->second.y)]++;
+	}
+
+	// Files that are in the index with the same size are redrawn where they are
+	vector<wstring>  inserts, updates;
+	vector<FileInfo> areas;
+	for (size_t i = 0; i < filenames.size(); i++)
+	{
+		FileMap::const_iterator j = files.find( GetIndexName(filenames[i]) );
+		unsigned long width, height;
+		if (j != files.end() && users[Position(j->second.x, j->second.y)] == 1 &&
+			ReadImageSize( filenames[i], width, height ) && width == j->second.w && height == j->second.h)
+		{
+			updates.push_back(filenames[i]);
+			areas.push_back(j->second);
+		}
+		else
+		{
+			inserts.push_back(filenames[i]);
+		}
+	}
+
+	// Decode on all cores; the areas do not overlap
+	vector<wstring> errors(updates.size());
+	UpdateJob job = { bitmap, &updates, &areas, &errors };
+	ParallelFor( updates.size(), UpdateWorker, &job );
+
+	wstring error;
+	vector<wstring> failed;
+	for (size_t i = 0; i < updates.size(); i++)
+	{
+		markDirty( areas[i].x - 1, areas[i].y - 1, areas[i].w + 2, areas[i].h + 2 );
+		if (!errors[i].empty())
+		{
+			// Whatever was decoded of it is garbage now
+			failed.push_back( GetIndexName(updates[i]) );
+			error = errors[i];
+		}
+	}
+	if (!updates.empty())
+	{
+		modified |= IMAGE;
+	}
+
+	if (!failed.empty())
+	{
+		deleteFiles(failed);
+		throw wruntime_error(error);
+	}
+
+	if (!inserts.empty())
+	{
+		insertFiles(inserts, NULL);
+	}
+}
+
+void FilePair::FilePairImpl::deleteFiles( const vector<wstring>& filenames )
+{
+	if (!readOnly)
 	{
-		fif = FreeImage_GetFIFFromFilenameU(filename.c_str());
+		// Decode the image first: if that fails, the index must stay as it is
+		ensureBitmap();
+
+		vector<FileInfo> removed;
+		removed.reserve(filenames.size());
+
+		for (vector<wstring>::const_iterator f = filenames.begin(); f != filenames.end(); f++)
+		{
+			FileMap::iterator i = files.find(*f);
+			if (i != files.end())
+			{
+				removed.push_back(i->second);
+				if (selected == &i->second)
+				{
+					selected = NULL;
+				}
+				files.erase(i);
+			}
+		}
+
+		if (!removed.empty())
+		{
+			// Erase the areas in the bitmap that no alias still uses
+			vector<FreeArea::RECT> released;
+			releaseAreas(removed, released);
+			freearea.addFreeAreas(released);
+			modified = IMAGE | INDEX;
+		}
 	}
+}
 
+FIBITMAP* FilePair::FilePairImpl::ReadBitmapFile( const wstring& filename )
+{
+	// Determine file format
+	FREE_IMAGE_FORMAT fif = GetFormatFromFile(filename);
 	if (fif == FIF_UNKNOWN || !FreeImage_FIFSupportsReading(fif))
 	{
 		throw wruntime_error(LoadString(IDS_ERROR_FORMAT_UNSUPPORTED));
 	}
 
-	FIBITMAP* tmp = FreeImage_LoadU(fif, filename.c_str(), 0);
+	if (fif == FIF_TARGA || fif == FIF_BMP)
+	{
+		FIBITMAP* dib = ReadNativeFile( filename );
+		if (dib != NULL)
+		{
+			return dib;
+		}
+	}
+
+	FIBITMAP* tmp = LoadImageFile(fif, filename, 0);
 	if (tmp == NULL)
 	{
 		throw wruntime_error(LoadString(IDS_ERROR_IMAGE_LOAD));
@@ -355,73 +1755,67 @@ FIBITMAP* FilePair::FilePairImpl::ReadBitmapFile( const wstring& filename )
 	return dib;
 }
 
-void FilePair::FilePairImpl::ReadIndexFile( const wstring& filename )
+void FilePair::FilePairImpl::ReadIndexFile( const wstring& filename, unsigned long width, unsigned long height )
 {
-	// Read the MTD file
-	HANDLE hFile = CreateFile(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-	if (hFile == INVALID_HANDLE_VALUE)
+	// Map the MTD file and parse the entries straight from the view
+	MappedFile file;
+	if (!file.open(filename))
 	{
 		throw wruntime_error(LoadString(IDS_ERROR_FILE_OPEN));
 	}
 
-	try
+	uint32_t count;
+	if (file.size() < sizeof count)
 	{
-		DWORD read;
-		uint32_t count;
-		if (!ReadFile(hFile, &count, sizeof count, &read, NULL) || read != sizeof count)
-		{
-			throw wruntime_error(LoadString(IDS_ERROR_FILE_READ));
-		}
-		unsigned long nStrings = letohl( count );
+		throw wruntime_error(LoadString(IDS_ERROR_FILE_READ));
+	}
+	memcpy(&count, file.data(), sizeof count);
+	unsigned long nStrings = letohl( count );
+
+	if ((file.size() - sizeof count) / sizeof(FILEINFO) < nStrings)
+	{
+		throw wruntime_error(LoadString(IDS_ERROR_FILE_READ));
+	}
 
-		unsigned int width  = FreeImage_GetWidth(bitmap);
-		unsigned int height = FreeImage_GetHeight(bitmap);
+	const FILEINFO* entries = (const FILEINFO*)(file.data() + sizeof count);
 
-		readOnly = false;
-		for (unsigned long i = 0; i < nStrings; i++)
-		{
-			FILEINFO input;
-			if (!ReadFile(hFile, &input, sizeof input, &read, NULL) || read != sizeof input)
-			{
-				throw wruntime_error(LoadString(IDS_ERROR_FILE_READ));
-			}
-			input.name[63] = '\0';
+	// Check all entries at once: their areas (including the 1px border) must
+	// lie inside the image and must not overlap, or the file is corrupt
+	ValidateIndex(entries, nStrings, width, height, problems);
+	readOnly = !problems.empty();
 
-			FileInfo fi = { letohl(input.x), letohl(input.y), letohl(input.w), letohl(input.h) };
-			fi.used = input.used;
+	vector<bool> valid(nStrings, true);
+	for (size_t i = 0; i < problems.size(); i++)
+	{
+		valid[problems[i].entry] = false;
+	}
 
-			WCHAR wstr[64];
-			wstr[63] = L'\0';
-			MultiByteToWideChar(CP_ACP, MB_PRECOMPOSED, input.name, 63, wstr, 63);
-			wstring filename(wstr);
+	// The areas in use, once for every group of aliases
+	vector<FreeArea::RECT> used;
+	set<Position> placed;
+	used.reserve(nStrings);
+	for (unsigned long i = 0; i < nStrings; i++)
+	{
+		const FILEINFO& input = entries[i];
 
-			transform(filename.begin(), filename.end(), filename.begin(), toupper );
-			files.insert( make_pair(filename, fi) );
+		FileInfo fi = { letohl(input.x), letohl(input.y), letohl(input.w), letohl(input.h) };
+		fi.used = input.used;
 
-			if ((fi.x == 0) || (fi.y == 0) || (fi.x + fi.w > width - 1) || (fi.y + fi.h > height - 1))
-			{
-				// The indicated area (including 1px border extension) falls outside the image.
-				// File is corrupt.
-				readOnly = true;
-			}
-			else if (!readOnly)
-			{
-				// Each image has a 1 pixel border around it.
-				if (!freearea.addUsedArea( fi.x - 1, fi.y - 1, fi.w + 2, fi.h + 2))
-				{
-					// The area was not completely unused. Overlap with another area occured.
-					// File is corrupt.
-					readOnly = true;
-				}
-			}
+		const char* end = (const char*)memchr(input.name, '\0', 63);
+		wstring filename = DecodeIndexName(input.name, (end != NULL) ? end - input.name : 63);
+
+		// We write the index in map order, so the hint is usually right
+		files.insert( files.end(), make_pair(filename, fi) );
+
+		if (valid[i] && placed.insert( Position(fi.x, fi.y) ).second)
+		{
+			FreeArea::RECT area = { fi.x - 1, fi.y - 1, fi.w + 2, fi.h + 2 };
+			used.push_back(area);
 		}
-		CloseHandle(hFile);
-	}
-	catch(...)
-	{
-		CloseHandle(hFile);
-		throw;
 	}
+
+	// Build the free area administration in one go
+	freearea.build(width, height, used);
 }
 
 FilePair::FilePairImpl::FilePairImpl( unsigned int width, unsigned int height)
@@ -431,19 +1825,127 @@ FilePair::FilePairImpl::FilePairImpl( unsigned int width, unsigned int height)
 	{
 		throw wruntime_error(LoadString(IDS_ERROR_BITMAP_CREATE));
 	}
+	lazyWidth  = width;
+	lazyHeight = height;
 
 	freearea.addFreeArea( 0, 0, width, height );
+	heuristic = FreeArea::FIRST_FIT;
+	compaction = false;
+	maxWidth  = 0;
+	maxHeight = 0;
+	syncOnSave = false;
+	compressImage = false;
+	lowMemory = false;
+	mergeOnInsert = false;
 	selected = NULL;
 	modified = 0;
 	readOnly = false;
 }
 
-FilePair::FilePairImpl::FilePairImpl( const wstring& filename1, const wstring& filename2)
+void FilePair::FilePairImpl::ensureBitmap()
+{
+	if (bitmap == NULL)
+	{
+		FIBITMAP* dib = ReadBitmapFile( imageFilename );
+		if (FreeImage_GetWidth(dib) != lazyWidth || FreeImage_GetHeight(dib) != lazyHeight)
+		{
+			// The file changed since the index was checked against it
+			FreeImage_Unload(dib);
+			throw wruntime_error(LoadString(IDS_ERROR_IMAGE_LOAD));
+		}
+		bitmap = dib;
+		rowTable.clear();
+	}
+}
+
+bool FilePair::FilePairImpl::openImageFile( MappedFile& file, TgaHeader& header )
+{
+	if (bitmap != NULL || FI_RGBA_RED != 2 || FI_RGBA_BLUE != 0)
+	{
+		return false;
+	}
+
+	// Only TGA files that we decode ourselves qualify
+	if (!file.open(imageFilename) || !ReadTgaHeader(file.data(), file.size(), header) ||
+		header.width != lazyWidth || header.height != lazyHeight)
+	{
+		file.close();
+		return false;
+	}
+
+	if (header.rle && rowTable.empty() && !IndexTgaRows(file.data(), file.size(), header, rowTable))
+	{
+		rowTable.clear();
+		throw wruntime_error(LoadString(IDS_ERROR_IMAGE_LOAD));
+	}
+	return true;
+}
+
+FIBITMAP* FilePair::FilePairImpl::copyArea( const FileInfo& fi )
+{
+	MappedFile file;
+	TgaHeader  header;
+	if (!openImageFile(file, header))
+	{
+		ensureBitmap();
+	}
+	return copyArea(fi, file, header);
+}
+
+FIBITMAP* FilePair::FilePairImpl::copyArea( const FileInfo& fi, const MappedFile& file, const TgaHeader& header ) const
+{
+	if (bitmap == NULL)
+	{
+		// Decode just the rows of the file
+		FIBITMAP* dib = FreeImage_Allocate(fi.w, fi.h, 32);
+		if (dib == NULL)
+		{
+			throw wruntime_error(LoadString(IDS_ERROR_BITMAP_COPY));
+		}
+
+		if (!DecodeTgaRegion(file.data(), file.size(), header, header.rle ? &rowTable : NULL, fi.x, fi.y, fi.w, fi.h, FreeImage_GetBits(dib), FreeImage_GetPitch(dib)))
+		{
+			FreeImage_Unload(dib);
+			throw wruntime_error(LoadString(IDS_ERROR_IMAGE_LOAD));
+		}
+		return dib;
+	}
+
+	FIBITMAP* dib = FreeImage_Copy(bitmap, fi.x, fi.y, fi.x + fi.w, fi.y + fi.h);
+	if (dib == NULL)
+	{
+		throw wruntime_error(LoadString(IDS_ERROR_BITMAP_COPY));
+	}
+	return dib;
+}
+
+FilePair::FilePairImpl::FilePairImpl( const wstring& filename1, const wstring& filename2, bool lazy)
 {
 	readOnly = false;
-	bitmap = ReadBitmapFile( filename2);
-	freearea.addFreeArea( 0, 0, FreeImage_GetWidth(bitmap), FreeImage_GetHeight(bitmap) );
-	ReadIndexFile(filename1);
+	heuristic = FreeArea::FIRST_FIT;
+	compaction = false;
+	maxWidth  = 0;
+	maxHeight = 0;
+	syncOnSave = false;
+	compressImage = false;
+	lowMemory = false;
+	mergeOnInsert = false;
+	bitmap = NULL;
+	if (!lazy || !ReadImageSize( filename2, lazyWidth, lazyHeight ))
+	{
+		bitmap     = ReadBitmapFile( filename2);
+		lazyWidth  = FreeImage_GetWidth(bitmap);
+		lazyHeight = FreeImage_GetHeight(bitmap);
+	}
+	try
+	{
+		ReadIndexFile(filename1, lazyWidth, lazyHeight);
+	}
+	catch (...)
+	{
+		FreeImage_Unload( bitmap );
+		throw;
+	}
 	indexFilename = filename1;
 	imageFilename = filename2;
 	selected = NULL;
@@ -452,7 +1954,10 @@ FilePair::FilePairImpl::FilePairImpl( const wstring& filename1, const wstring& f
 
 FilePair::FilePairImpl::~FilePairImpl()
 {
-	FreeImage_Unload( bitmap );
+	if (bitmap != NULL)
+	{
+		FreeImage_Unload( bitmap );
+	}
 }
 
 //
@@ -495,9 +2000,19 @@ bool FilePair::isReadOnly() const
 	return pimpl->readOnly;
 }
 
-void FilePair::insertFiles( vector<wstring>& filenames )
+const vector<IndexProblem>& FilePair::getIndexProblems() const
+{
+	return pimpl->problems;
+}
+
+void FilePair::insertFiles( vector<wstring>& filenames, vector<wstring>* overflow )
+{
+	pimpl->insertFiles(filenames, overflow);
+}
+
+void FilePair::updateFiles( vector<wstring>& filenames )
 {
-	pimpl->insertFiles(filenames);
+	pimpl->updateFiles(filenames);
 }
 
 const FileInfo* FilePair::getSelected() const
@@ -517,10 +2032,20 @@ bool FilePair::setSelected(const std::wstring filename)
 	return false;
 }
 
+#ifdef _WIN32
 BOOL FilePair::BltSelected(HDC hdcDest, int nXDest, int nYDest)
 {
 	if (pimpl->selected != NULL)
 	{
+		try
+		{
+			pimpl->ensureBitmap();
+		}
+		catch (wexception&)
+		{
+			return FALSE;
+		}
+
 		FileInfo* fi = pimpl->selected;
 		SetStretchBltMode(hdcDest, COLORONCOLOR );
 		return StretchDIBits(hdcDest,
@@ -532,6 +2057,43 @@ BOOL FilePair::BltSelected(HDC hdcDest, int nXDest, int nYDest)
 	}
 	return FALSE;
 }
+#endif
+
+void FilePair::setHeuristic(FreeArea::Heuristic heuristic)
+{
+	pimpl->heuristic = heuristic;
+}
+
+void FilePair::setCompaction(bool enable)
+{
+	pimpl->compaction = enable;
+}
+
+void FilePair::setMaxSize(unsigned long width, unsigned long height)
+{
+	pimpl->maxWidth  = width;
+	pimpl->maxHeight = height;
+}
+
+void FilePair::setSyncOnSave(bool enable)
+{
+	pimpl->syncOnSave = enable;
+}
+
+void FilePair::setCompressImage(bool enable)
+{
+	pimpl->compressImage = enable;
+}
+
+void FilePair::setLowMemoryInsert(bool enable)
+{
+	pimpl->lowMemory = enable;
+}
+
+void FilePair::setMergeDuplicates(bool enable)
+{
+	pimpl->mergeOnInsert = enable;
+}
 
 const FileMap& FilePair::getFiles() const
 {
@@ -543,10 +2105,15 @@ void FilePair::extractFile( const wstring& filename, const wstring& target, FREE
 	FileMap::const_iterator i = pimpl->files.find(filename);
 	if (i != pimpl->files.end())
 	{
-		pimpl->saveBitmapFile(i->second, pimpl->bitmap, target, format);
+		pimpl->saveBitmapFile(i->second, target, format);
 	}
 }
 
+void FilePair::extractFiles( const vector<wstring>& filenames, const vector<wstring>& targets, vector<wstring>& errors, FREE_IMAGE_FORMAT format )
+{
+	pimpl->extractFiles(filenames, targets, errors, format);
+}
+
 bool FilePair::renameFile(const wstring& filename, const wstring& target)
 {
 	if (!pimpl->readOnly && target != L"")
@@ -560,7 +2127,7 @@ bool FilePair::renameFile(const wstring& filename, const wstring& target)
 				FileInfo fi = i->second;
 				pimpl->files.erase(i);
 				pimpl->files.insert( make_pair(target, fi) );
-				pimpl->modified = IMAGE | INDEX;
+				pimpl->modified |= INDEX;
 				return true;
 			}
 		}
@@ -568,25 +2135,30 @@ bool FilePair::renameFile(const wstring& filename, const wstring& target)
 	return false;
 }
 
+void FilePair::repack( FreeArea::Heuristic heuristic )
+{
+	pimpl->repack(heuristic);
+}
+
+size_t FilePair::mergeDuplicates()
+{
+	return pimpl->mergeDuplicates();
+}
+
 void FilePair::deleteFile( const wstring& filename )
 {
-	if (!pimpl->readOnly)
-	{
-		FileMap::iterator i = pimpl->files.find(filename);
-		if (i != pimpl->files.end())
-		{
-			// Erase the area in the bitmap
-			FIBITMAP* dib = FreeImage_Allocate(i->second.w + 2, i->second.h + 2, 32);
-			if (dib != NULL)
-			{
-				FreeImage_Paste(pimpl->bitmap, dib, i->second.x - 1, i->second.y - 1, 255 );
-				FreeImage_Unload(dib);
-			}
-			pimpl->freearea.addFreeArea( i->second.x - 1, i->second.y - 1, i->second.w + 2, i->second.h + 2 );
-			pimpl->files.erase(i);
-			pimpl->modified = IMAGE | INDEX;
-		}
-	}
+	deleteFiles( vector<wstring>(1, filename) );
+}
+
+void FilePair::deleteFiles( const vector<wstring>& filenames )
+{
+	pimpl->deleteFiles(filenames);
+}
+
+bool FilePair::isImageFile( const wstring& filename )
+{
+	FREE_IMAGE_FORMAT fif = GetFormatFromName(filename);
+	return fif != FIF_UNKNOWN && FreeImage_FIFSupportsReading(fif);
 }
 
 void FilePair::saveIndex(const std::wstring& filename)
@@ -601,12 +2173,20 @@ void FilePair::saveImage(const std::wstring& filename, FREE_IMAGE_FORMAT format)
 
 void FilePair::save(FREE_IMAGE_FORMAT format)
 {
-	pimpl->saveIndex(pimpl->indexFilename);
-	pimpl->saveImage(pimpl->imageFilename, format);
+	// Only rewrite what changed. The image goes first, so the index never
+	// refers to areas that are not in the image on disk yet.
+	if (pimpl->modified & IMAGE)
+	{
+		pimpl->saveImage(pimpl->imageFilename, format);
+	}
+	if (pimpl->modified & INDEX)
+	{
+		pimpl->saveIndex(pimpl->indexFilename);
+	}
 }
 
-FilePair::FilePair(const wstring& filename1, const wstring& filename2)
-	: pimpl(new FilePairImpl(filename1, filename2))
+FilePair::FilePair(const wstring& filename1, const wstring& filename2, bool lazy)
+	: pimpl(new FilePairImpl(filename1, filename2, lazy))
 {
 }
 
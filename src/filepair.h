@@ -4,22 +4,17 @@
 #ifndef FILEPAIR_H
 #define FILEPAIR_H
 
+#ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#endif
 #include <string>
 #include <vector>
 #include <map>
 
 #include <FreeImage.h>
-
-struct FileInfo
-{
-	unsigned long x, y;
-	unsigned long w, h;
-	unsigned char used;
-};
-
-typedef std::map<std::wstring,FileInfo> FileMap;
+#include "freearea.h"
+#include "mtdindex.h"
 
 class FilePair
 {
@@ -37,23 +32,92 @@ public:
 	bool                isUnnamed() const;			// Does the pair have a name?
 	bool                isReadOnly() const;          // Is this file read only?
 
+	// What is wrong with the index, if it was found corrupt when it was read
+	const std::vector<IndexProblem>& getIndexProblems() const;
+
+#ifdef _WIN32
 	// Blit the selected file to the Device Context at specified coordinates
 	BOOL BltSelected(HDC hdcDest, int nXDest, int nYDest);
+#endif
 	bool setSelected(const std::wstring filename);
 
+	// Select how free space is chosen for inserted files (default: first fit)
+	void setHeuristic(FreeArea::Heuristic heuristic);
+
+	// Move a few files around to make room for an inserted file before
+	// growing the image (default: off)
+	void setCompaction(bool enable);
+
+	// Never let the image grow beyond this size (default: 0, unlimited)
+	void setMaxSize(unsigned long width, unsigned long height);
+
+	// Flush saved files to the disk before returning (default: off)
+	void setSyncOnSave(bool enable);
+
+	// Save TGA images RLE-compressed (default: off). Uncompressed images
+	// can have just their changed rows rewritten on the next save; unlike a
+	// full save, such a patch is not atomic.
+	void setCompressImage(bool enable);
+
+	// Read only the sizes of inserted files up front and decode each one
+	// right before it is pasted, on a single thread, so at most one is in
+	// memory (default: off). TGA and BMP files are always decoded straight
+	// into the image once placed; this extends that to the other formats.
+	void setLowMemoryInsert(bool enable);
+
+	// Let an inserted file that has the same pixels as another inserted file,
+	// or as a file in the index, share the area of that file instead of
+	// taking one of its own (default: off). Its index entry then has the same
+	// coordinates, which not every reader of MTD files may accept. Has no
+	// effect together with setLowMemoryInsert.
+	void setMergeDuplicates(bool enable);
+
 	// Directory manipulation
-	void insertFiles(std::vector<std::wstring>& filenames);
+	// If the files do not all fit within the maximum size, the ones that do not
+	// are moved from filenames to overflow, or nothing is inserted if it is NULL.
+	// TGA and BMP files are checked completely before anything changes, so a
+	// damaged one leaves the pair as it was. If a file still fails to load
+	// once the image has been changed (it changed on disk in the meantime, or,
+	// with setLowMemoryInsert, a file in another format failed), the files
+	// that did load stay inserted and the error is thrown afterwards.
+	void insertFiles(std::vector<std::wstring>& filenames, std::vector<std::wstring>* overflow = NULL);
+
+	// Like insertFiles, but files that are already in the index at the same
+	// size are redrawn in place, so they keep their position. If one of those
+	// fails to load, it is deleted, since its area has been overwritten.
+	void updateFiles(std::vector<std::wstring>& filenames);
 	bool renameFile(const std::wstring& filename, const std::wstring& target);
 	void extractFile( const std::wstring& filename, const std::wstring& target, FREE_IMAGE_FORMAT format = FIF_UNKNOWN );
+
+	// Extract filenames[i] to targets[i] for every i, on all processor cores.
+	// A failure does not stop the others: errors[i] receives the message for
+	// filenames[i], or stays empty if it was extracted.
+	void extractFiles( const std::vector<std::wstring>& filenames, const std::vector<std::wstring>& targets, std::vector<std::wstring>& errors, FREE_IMAGE_FORMAT format = FIF_UNKNOWN );
 	void deleteFile( const std::wstring& filename );
 
-	// Save both or either file
+	// Delete all these files at once; names that are not in the index are skipped
+	void deleteFiles( const std::vector<std::wstring>& filenames );
+
+	// Can files of this name be inserted? Judged by the extension only.
+	static bool isImageFile(const std::wstring& filename);
+
+	// Re-place all files to get rid of unused space and shrink the image
+	// to the smallest size that holds them. No files are read for this.
+	void repack( FreeArea::Heuristic heuristic = FreeArea::BEST_SHORT_SIDE_FIT );
+
+	// Let files in the index with the same pixels share one area, freeing
+	// the others. Returns the number of index entries that were moved.
+	size_t mergeDuplicates();
+
+	// Save both or either file. When saving both separately, save the image
+	// first, so the index never refers to areas that are not on disk yet.
 	void save(FREE_IMAGE_FORMAT format = FIF_UNKNOWN);
 	void saveIndex(const std::wstring& filename);
 	void saveImage(const std::wstring& filename, FREE_IMAGE_FORMAT format = FIF_UNKNOWN);
 
-	// Open an MTD and TGA file
-	FilePair(const std::wstring& mtdFilename, const std::wstring& tgaFilename);
+	// Open an MTD and TGA file. When lazy, only the size of the image is read
+	// up front; the pixels are decoded when an operation first needs them.
+	FilePair(const std::wstring& mtdFilename, const std::wstring& tgaFilename, bool lazy = false);
 
 	// Create an empty image and directory
 	FilePair(unsigned int width, unsigned int height);
@@ -4,41 +4,362 @@
 //
 // Programmer's note:
 // This may not be the most efficient implementation, but it's a hard
-// problem anyway.
+// problem anyway. The free rectangles are kept in a uniform grid so that
+// splitting and containment checks only have to look at nearby rectangles
+// instead of the entire list, and in width buckets so that allocation only
+// has to look at rectangles that are large enough.
 //
+#include <algorithm>
+#include <climits>
+#include <map>
 #include "freearea.h"
 
 using namespace std;
 
+//
+// Grid
+//
+FreeArea::Grid::Grid()
+	: width(0), height(0)
+{
+}
+
+void FreeArea::Grid::grow(unsigned long cx, unsigned long cy)
+{
+	// Make sure cell (cx,cy) exists. Grow by doubling to keep this rare.
+	unsigned long newWidth  = max(width,  1UL);
+	unsigned long newHeight = max(height, 1UL);
+	while (newWidth  <= cx) newWidth  *= 2;
+	while (newHeight <= cy) newHeight *= 2;
+
+	vector< vector<size_t> > newCells(newWidth * newHeight);
+	for (unsigned long y = 0; y < height; y++)
+	{
+		for (unsigned long x = 0; x < width; x++)
+		{
+			newCells[y * newWidth + x].swap( cells[y * width + x] );
+		}
+	}
+	cells.swap(newCells);
+	width  = newWidth;
+	height = newHeight;
+}
+
+void FreeArea::Grid::insert(size_t index, const RECT& rect)
+{
+	unsigned long x1 = (rect.x) >> CELL_SHIFT, x2 = (rect.x + rect.w - 1) >> CELL_SHIFT;
+	unsigned long y1 = (rect.y) >> CELL_SHIFT, y2 = (rect.y + rect.h - 1) >> CELL_SHIFT;
+	if (x2 >= width || y2 >= height)
+	{
+		grow(x2, y2);
+	}
+
+	for (unsigned long y = y1; y <= y2; y++)
+	{
+		for (unsigned long x = x1; x <= x2; x++)
+		{
+			cells[y * width + x].push_back(index);
+		}
+	}
+}
+
+void FreeArea::Grid::remove(size_t index, const RECT& rect)
+{
+	unsigned long x1 = (rect.x) >> CELL_SHIFT, x2 = (rect.x + rect.w - 1) >> CELL_SHIFT;
+	unsigned long y1 = (rect.y) >> CELL_SHIFT, y2 = (rect.y + rect.h - 1) >> CELL_SHIFT;
+	for (unsigned long y = y1; y <= y2; y++)
+	{
+		for (unsigned long x = x1; x <= x2; x++)
+		{
+			vector<size_t>& cell = cells[y * width + x];
+			vector<size_t>::iterator p = find(cell.begin(), cell.end(), index);
+			if (p != cell.end())
+			{
+				*p = cell.back();
+				cell.pop_back();
+			}
+		}
+	}
+}
+
+const vector<size_t>* FreeArea::Grid::at(unsigned long x, unsigned long y) const
+{
+	x >>= CELL_SHIFT;
+	y >>= CELL_SHIFT;
+	return (x < width && y < height) ? &cells[y * width + x] : NULL;
+}
+
+void FreeArea::Grid::query(const RECT& rect, vector<size_t>& result) const
+{
+	result.clear();
+	if (rect.w == 0 || rect.h == 0 || (rect.x >> CELL_SHIFT) >= width || (rect.y >> CELL_SHIFT) >= height)
+	{
+		return;
+	}
+
+	unsigned long x1 = (rect.x) >> CELL_SHIFT, x2 = min((rect.x + rect.w - 1) >> CELL_SHIFT, width  - 1);
+	unsigned long y1 = (rect.y) >> CELL_SHIFT, y2 = min((rect.y + rect.h - 1) >> CELL_SHIFT, height - 1);
+	for (unsigned long y = y1; y <= y2; y++)
+	{
+		for (unsigned long x = x1; x <= x2; x++)
+		{
+			const vector<size_t>& cell = cells[y * width + x];
+			result.insert(result.end(), cell.begin(), cell.end());
+		}
+	}
+
+	// A rectangle that spans several cells is reported by each of them
+	sort(result.begin(), result.end());
+	result.erase( unique(result.begin(), result.end()), result.end() );
+}
+
+//
+// FreeArea
+//
+static unsigned int GetBucket(unsigned long width)
+{
+	unsigned int bucket = 0;
+	while (width >>= 1) bucket++;
+	return bucket;
+}
+
+void FreeArea::addToBucket( size_t index )
+{
+	Bucket& bucket = Buckets[ GetBucket(Rects[index].w) ];
+	if (BucketPos.size() <= index)
+	{
+		BucketPos.resize(index + 1);
+	}
+	BucketPos[index] = bucket.rects.size();
+	bucket.rects.push_back(index);
+	bucket.maxHeight = max(bucket.maxHeight, Rects[index].h);
+}
+
+void FreeArea::removeFromBucket( size_t index )
+{
+	Bucket& bucket = Buckets[ GetBucket(Rects[index].w) ];
+	size_t  pos    = BucketPos[index];
+	bucket.rects[pos] = bucket.rects.back();
+	BucketPos[ bucket.rects[pos] ] = pos;
+	bucket.rects.pop_back();
+	if (Rects[index].h == bucket.maxHeight)
+	{
+		bucket.stale = true;
+	}
+}
+
+unsigned long FreeArea::getMaxHeight( unsigned int index )
+{
+	Bucket& bucket = Buckets[index];
+	if (bucket.stale)
+	{
+		bucket.maxHeight = 0;
+		for (vector<size_t>::const_iterator p = bucket.rects.begin(); p != bucket.rects.end(); p++)
+		{
+			bucket.maxHeight = max(bucket.maxHeight, Rects[*p].h);
+		}
+		bucket.stale = false;
+	}
+	return bucket.maxHeight;
+}
+
 void FreeArea::addRect( const RECT& rect )
 {
-	// Check if the rectangle is completely contained within an existing rectangle
-	for (vector<RECT>::iterator p = Rects.begin(); p != Rects.end(); p++)
+	if (rect.w == 0 || rect.h == 0)
 	{
-		if ((rect.x >= p->x) && (rect.x + rect.w <= p->x + p->w) &&
-			(rect.y >= p->y) && (rect.y + rect.h <= p->y + p->h))
+		// Empty rectangles can never hold anything
+		return;
+	}
+
+	// Check if the rectangle is completely contained within an existing rectangle.
+	// Any such rectangle must overlap the cell that holds the top-left corner.
+	const vector<size_t>* cell = Index.at(rect.x, rect.y);
+	if (cell != NULL)
+	{
+		for (vector<size_t>::const_iterator i = cell->begin(); i != cell->end(); i++)
 		{
-			return;
+			const RECT* p = &Rects[*i];
+			if ((rect.x >= p->x) && (rect.x + rect.w <= p->x + p->w) &&
+				(rect.y >= p->y) && (rect.y + rect.h <= p->y + p->h))
+			{
+				return;
+			}
 		}
 	}
 
 	// If not, add it
+	size_t index;
 	if (Recycled.empty())
 	{
+		index = Rects.size();
 		Rects.push_back( rect );
 	}
 	else
 	{
-		Rects[ Recycled.top() ] = rect;
+		index = Recycled.top();
+		Rects[ index ] = rect;
 		Recycled.pop();
 	}
+	Index.insert(index, rect);
+	addToBucket(index);
+}
+
+void FreeArea::killRect( size_t index )
+{
+	Index.remove(index, Rects[index]);
+	removeFromBucket(index);
+	Rects[index].w = 0;
+	Recycled.push(index);
+}
+
+static inline bool Contains(const FreeArea::RECT& outer, const FreeArea::RECT& inner)
+{
+	return (inner.x >= outer.x) && (inner.x + inner.w <= outer.x + outer.w) &&
+	       (inner.y >= outer.y) && (inner.y + inner.h <= outer.y + outer.h);
+}
+
+void FreeArea::mergeRect( RECT rect )
+{
+	// Rectangles that can be grown into the new rectangle
+	vector<RECT> grown;
+
+	vector<size_t> candidates;
+	bool changed;
+	do
+	{
+		changed = false;
+
+		// Look at everything that overlaps or touches the rectangle
+		RECT around = { rect.x > 0 ? rect.x - 1 : 0, rect.y > 0 ? rect.y - 1 : 0, 0, 0 };
+		around.w = rect.x + rect.w + 1 - around.x;
+		around.h = rect.y + rect.h + 1 - around.y;
+		Index.query(around, candidates);
+
+		for (vector<size_t>::const_iterator i = candidates.begin(); i != candidates.end() && !changed; i++)
+		{
+			RECT r = Rects[*i];
+			if (r.w == 0)
+			{
+				continue;
+			}
+
+			if (Contains(r, rect))
+			{
+				// Nothing new; addRect will drop it
+				break;
+			}
+
+			if (Contains(rect, r))
+			{
+				// Dominated by the new rectangle
+				killRect(*i);
+				continue;
+			}
+
+			bool touchH = (r.x <= rect.x + rect.w) && (rect.x <= r.x + r.w);
+			bool touchV = (r.y <= rect.y + rect.h) && (rect.y <= r.y + r.h);
+			if (touchH && r.y <= rect.y && r.y + r.h >= rect.y + rect.h)
+			{
+				// r spans the rectangle vertically; stretch the rectangle horizontally over it
+				unsigned long x1 = min(r.x, rect.x), x2 = max(r.x + r.w, rect.x + rect.w);
+				changed = (x1 != rect.x || x2 != rect.x + rect.w);
+				rect.x = x1;
+				rect.w = x2 - x1;
+			}
+			else if (touchV && r.x <= rect.x && r.x + r.w >= rect.x + rect.w)
+			{
+				// r spans the rectangle horizontally; stretch the rectangle vertically over it
+				unsigned long y1 = min(r.y, rect.y), y2 = max(r.y + r.h, rect.y + rect.h);
+				changed = (y1 != rect.y || y2 != rect.y + rect.h);
+				rect.y = y1;
+				rect.h = y2 - y1;
+			}
+			else if (touchH && rect.y <= r.y && rect.y + rect.h >= r.y + r.h)
+			{
+				// The rectangle spans r vertically; stretch r horizontally over it
+				unsigned long x1 = min(r.x, rect.x), x2 = max(r.x + r.w, rect.x + rect.w);
+				RECT nr = {x1, r.y, x2 - x1, r.h};
+				grown.push_back(nr);
+				killRect(*i);
+			}
+			else if (touchV && rect.x <= r.x && rect.x + rect.w >= r.x + r.w)
+			{
+				// The rectangle spans r horizontally; stretch r vertically over it
+				unsigned long y1 = min(r.y, rect.y), y2 = max(r.y + r.h, rect.y + rect.h);
+				RECT nr = {r.x, y1, r.w, y2 - y1};
+				grown.push_back(nr);
+				killRect(*i);
+			}
+		}
+	} while (changed);
+
+	addRect(rect);
+
+	for (vector<RECT>::const_iterator p = grown.begin(); p != grown.end(); p++)
+	{
+		// Drop whatever the grown rectangle now covers
+		Index.query(*p, candidates);
+		for (vector<size_t>::const_iterator i = candidates.begin(); i != candidates.end(); i++)
+		{
+			if (Rects[*i].w != 0 && Contains(*p, Rects[*i]))
+			{
+				killRect(*i);
+			}
+		}
+		addRect(*p);
+	}
+}
+
+void FreeArea::compact()
+{
+	if (Recycled.size() < 64 || Recycled.size() < Rects.size() / 2)
+	{
+		return;
+	}
+
+	// Rebuild the list without the holes, keeping the order of the rest
+	vector<RECT> rects;
+	rects.reserve(Rects.size() - Recycled.size());
+	for (vector<RECT>::const_iterator p = Rects.begin(); p != Rects.end(); p++)
+	{
+		if (p->w != 0)
+		{
+			rects.push_back(*p);
+		}
+	}
+
+	clear();
+	Rects.swap(rects);
+	for (size_t i = 0; i < Rects.size(); i++)
+	{
+		Index.insert(i, Rects[i]);
+		addToBucket(i);
+	}
+}
+
+void FreeArea::clear()
+{
+	Rects.clear();
+	Recycled = stack<size_t>();
+	Index    = Grid();
+	for (unsigned int b = 0; b < BUCKET_COUNT; b++)
+	{
+		Buckets[b] = Bucket();
+	}
+	BucketPos.clear();
 }
 
 bool FreeArea::removeRect( const RECT& rect )
 {
+	// Visit the intersecting rectangles in list order; this keeps the
+	// recycling order, and thus the outcome of getFreeArea, deterministic.
+	vector<size_t> candidates;
+	Index.query(rect, candidates);
+
 	bool complete = false;
-	for (size_t i = 0; i < Rects.size(); i++)
+	for (vector<size_t>::const_iterator p = candidates.begin(); p != candidates.end(); p++)
 	{
+		size_t i = *p;
 		if (Rects[i].w != 0 &&
 			(rect.x + rect.w > Rects[i].x) && (rect.x < Rects[i].x + Rects[i].w) &&
 			(rect.y + rect.h > Rects[i].y) && (rect.y < Rects[i].y + Rects[i].h))
@@ -53,8 +374,7 @@ bool FreeArea::removeRect( const RECT& rect )
 
 			// Remove it
 			RECT r = Rects[i];
-			Rects[i].w = 0;
-			Recycled.push(i);
+			killRect(i);
 
 			// Now create (at most four) rectangles that describe the remainder
 			if (rect.x > r.x)
@@ -89,36 +409,455 @@ bool FreeArea::removeRect( const RECT& rect )
 	return complete;
 }
 
-bool FreeArea::getFreeArea( RECT& area )
+unsigned long FreeArea::getFreeLength( unsigned long x, unsigned long y, unsigned long length, bool horizontal ) const
 {
-	// Find a free rectangle that can hold the area
-	for (vector<RECT>::iterator p = Rects.begin(); p != Rects.end(); p++)
+	RECT line = {x, y, horizontal ? length : 1, horizontal ? 1 : length};
+
+	vector<size_t> candidates;
+	Index.query(line, candidates);
+
+	// Collect the parts of the line covered by free rectangles
+	vector< pair<unsigned long, unsigned long> > spans;
+	for (vector<size_t>::const_iterator p = candidates.begin(); p != candidates.end(); p++)
+	{
+		const RECT& r = Rects[*p];
+		if (r.w != 0 &&
+			(line.x + line.w > r.x) && (line.x < r.x + r.w) &&
+			(line.y + line.h > r.y) && (line.y < r.y + r.h))
+		{
+			if (horizontal) spans.push_back( make_pair(max(r.x, x), min(r.x + r.w, x + length)) );
+			else            spans.push_back( make_pair(max(r.y, y), min(r.y + r.h, y + length)) );
+		}
+	}
+
+	// Measure their union
+	sort(spans.begin(), spans.end());
+	unsigned long total = 0, end = 0;
+	for (vector< pair<unsigned long, unsigned long> >::const_iterator p = spans.begin(); p != spans.end(); p++)
 	{
-		if ((p->w >= area.w) && (p->h >= area.h))
+		unsigned long start = max(p->first, end);
+		if (p->second > start)
 		{
-			// Found one, remove it
-			RECT rect;
-			rect.x = area.x = p->x;
-			rect.y = area.y = p->y;
-			rect.w = area.w;
-			rect.h = area.h;
-			removeRect(rect);
-			return true;
+			total += p->second - start;
+			end    = p->second;
 		}
 	}
+	return total;
+}
 
-	// No rectangle could hold the area
-	return false;
+unsigned long FreeArea::getContactLength( const RECT& area ) const
+{
+	// Space outside the rectangles (the edge of the image) counts as used
+	unsigned long contact = 2 * (area.w + area.h);
+	if (area.x > 0) contact -= getFreeLength(area.x - 1, area.y, area.h, false);
+	if (area.y > 0) contact -= getFreeLength(area.x, area.y - 1, area.w, true);
+	contact -= getFreeLength(area.x + area.w, area.y, area.h, false);
+	contact -= getFreeLength(area.x, area.y + area.h, area.w, true);
+	return contact;
+}
+
+bool FreeArea::getFreeArea( RECT& area, Heuristic heuristic )
+{
+	// Find a free rectangle that can hold the area.
+	// Lower scores are better; ties are won by the rectangle earliest in the list.
+	// Scores are kept in 64 bits, so areas cannot wrap around where
+	// unsigned long has 32
+	size_t             best = Rects.size();
+	unsigned long long bestScore1 = 0, bestScore2 = 0;
+	for (unsigned int b = GetBucket(area.w); b < BUCKET_COUNT; b++)
+	{
+		if (Buckets[b].rects.empty() || getMaxHeight(b) < area.h)
+		{
+			// Nothing in this bucket is high enough
+			continue;
+		}
+
+		const vector<size_t>& rects = Buckets[b].rects;
+		for (vector<size_t>::const_iterator i = rects.begin(); i != rects.end(); i++)
+		{
+			const RECT* p = &Rects[*i];
+			if ((p->w >= area.w) && (p->h >= area.h))
+			{
+				unsigned long leftoverH = p->w - area.w;
+				unsigned long leftoverV = p->h - area.h;
+				unsigned long long score1 = 0, score2 = 0;
+				switch (heuristic)
+				{
+					case FIRST_FIT:
+						break;
+
+					case BEST_SHORT_SIDE_FIT:
+						score1 = min(leftoverH, leftoverV);
+						score2 = max(leftoverH, leftoverV);
+						break;
+
+					case BEST_LONG_SIDE_FIT:
+						score1 = max(leftoverH, leftoverV);
+						score2 = min(leftoverH, leftoverV);
+						break;
+
+					case BEST_AREA_FIT:
+						score1 = (unsigned long long)p->w * p->h - (unsigned long long)area.w * area.h;
+						score2 = min(leftoverH, leftoverV);
+						break;
+
+					case BOTTOM_LEFT:
+						score1 = (unsigned long long)p->y + area.h;
+						score2 = p->x;
+						break;
+
+					case CONTACT_POINT:
+					{
+						RECT placed = {p->x, p->y, area.w, area.h};
+						score1 = ULONG_MAX - getContactLength(placed);
+						break;
+					}
+				}
+
+				if (best == Rects.size() || score1 < bestScore1 ||
+					(score1 == bestScore1 && (score2 < bestScore2 || (score2 == bestScore2 && *i < best))))
+				{
+					best       = *i;
+					bestScore1 = score1;
+					bestScore2 = score2;
+				}
+			}
+		}
+	}
+
+	if (best == Rects.size())
+	{
+		// No rectangle could hold the area
+		return false;
+	}
+
+	// Found one, remove it
+	RECT rect;
+	rect.x = area.x = Rects[best].x;
+	rect.y = area.y = Rects[best].y;
+	rect.w = area.w;
+	rect.h = area.h;
+	removeRect(rect);
+	return true;
 }
 
 bool FreeArea::addUsedArea( int x, int y, int width, int height )
 {
-	RECT rect = {x, y, width, height};
+	RECT rect = {(unsigned long)x, (unsigned long)y, (unsigned long)width, (unsigned long)height};
 	return removeRect( rect );
 }
 
 void FreeArea::addFreeArea( int x, int y, int width, int height )
 {	
-	RECT rect = {x, y, width, height};
-	addRect( rect );
+	RECT rect = {(unsigned long)x, (unsigned long)y, (unsigned long)width, (unsigned long)height};
+	if (rect.w != 0 && rect.h != 0)
+	{
+		mergeRect( rect );
+		compact();
+	}
+}
+
+void FreeArea::getFreeRects( vector<RECT>& rects ) const
+{
+	rects.clear();
+	for (vector<RECT>::const_iterator p = Rects.begin(); p != Rects.end(); p++)
+	{
+		// Skip the recycled slots
+		if (p->w != 0)
+		{
+			rects.push_back(*p);
+		}
+	}
+}
+
+static bool CompareRows(const FreeArea::RECT& a, const FreeArea::RECT& b)
+{
+	if (a.y != b.y) return a.y < b.y;
+	if (a.h != b.h) return a.h < b.h;
+	return a.x < b.x;
+}
+
+static bool CompareColumns(const FreeArea::RECT& a, const FreeArea::RECT& b)
+{
+	if (a.x != b.x) return a.x < b.x;
+	if (a.w != b.w) return a.w < b.w;
+	return a.y < b.y;
+}
+
+static bool CompareReading(const FreeArea::RECT& a, const FreeArea::RECT& b)
+{
+	if (a.y != b.y) return a.y < b.y;
+	if (a.x != b.x) return a.x < b.x;
+	if (a.w != b.w) return a.w < b.w;
+	return a.h < b.h;
 }
+
+static bool SameRect(const FreeArea::RECT& a, const FreeArea::RECT& b)
+{
+	return a.x == b.x && a.y == b.y && a.w == b.w && a.h == b.h;
+}
+
+static bool CompareAreaDesc(const FreeArea::RECT& a, const FreeArea::RECT& b)
+{
+	return (unsigned long long)a.w * a.h > (unsigned long long)b.w * b.h;
+}
+
+// Join the rectangles that sit side by side with the same top and height
+// (horizontal) or the same left and width (vertical)
+static void JoinAdjacent(vector<FreeArea::RECT>& rects, bool horizontal)
+{
+	sort(rects.begin(), rects.end(), horizontal ? CompareRows : CompareColumns);
+
+	size_t n = 0;
+	for (size_t i = 0; i < rects.size(); i++)
+	{
+		if (n > 0)
+		{
+			FreeArea::RECT& last = rects[n - 1];
+			const FreeArea::RECT& r = rects[i];
+			if (horizontal && last.y == r.y && last.h == r.h && last.x + last.w == r.x)
+			{
+				last.w += r.w;
+				continue;
+			}
+			if (!horizontal && last.x == r.x && last.w == r.w && last.y + last.h == r.y)
+			{
+				last.h += r.h;
+				continue;
+			}
+		}
+		rects[n++] = rects[i];
+	}
+	rects.resize(n);
+}
+
+void FreeArea::addFreeAreas( vector<RECT> areas )
+{
+	size_t n = 0;
+	for (size_t i = 0; i < areas.size(); i++)
+	{
+		if (areas[i].w != 0 && areas[i].h != 0)
+		{
+			areas[n++] = areas[i];
+		}
+	}
+	areas.resize(n);
+
+	JoinAdjacent(areas, true);
+	JoinAdjacent(areas, false);
+
+	// Large rectangles first, so the small ones mostly fold into them
+	sort(areas.begin(), areas.end(), CompareAreaDesc);
+	for (vector<RECT>::const_iterator p = areas.begin(); p != areas.end(); p++)
+	{
+		mergeRect( *p );
+	}
+	compact();
+}
+
+// Where a used area starts or ends along the y axis
+struct BuildEvent
+{
+	unsigned long y;
+	bool          start;		// Ends come before starts at the same y
+	unsigned long left, right;
+	size_t        area;			// Index in the list of used areas
+
+	bool operator < (const BuildEvent& e) const {
+		return (y != e.y) ? y < e.y : (start != e.start) ? !start : left < e.left;
+	}
+};
+
+// The columns under the sweep line, as runs of columns that have been free
+// since the same row, keyed by their left end. Used columns have USED.
+typedef map<unsigned long, unsigned long> ColumnMap;
+static const unsigned long USED = ULONG_MAX;
+
+// Make sure a run starts at x
+static void SplitColumns( ColumnMap& columns, unsigned long x )
+{
+	ColumnMap::iterator c = columns.upper_bound(x);
+	--c;
+	if (c->first != x)
+	{
+		columns.insert(c, make_pair(x, c->second));
+	}
+}
+
+// Set the columns [left,right) of a width-wide line to top
+static void SetColumns( ColumnMap& columns, unsigned long width, unsigned long left, unsigned long right, unsigned long top )
+{
+	SplitColumns(columns, left);
+	if (right < width)
+	{
+		SplitColumns(columns, right);
+	}
+
+	ColumnMap::iterator first = columns.find(left);
+	ColumnMap::iterator last  = columns.lower_bound(right);
+	columns.erase(++ColumnMap::iterator(first), last);
+	first->second = top;
+
+	// Join the runs with their neighbours where they are equal
+	if (last != columns.end() && last->second == top)
+	{
+		columns.erase(last);
+	}
+	if (first != columns.begin())
+	{
+		ColumnMap::iterator prev = first;
+		if ((--prev)->second == top)
+		{
+			columns.erase(first);
+		}
+	}
+}
+
+// A column of the histogram in FindMaximal
+struct Bar
+{
+	unsigned long x, h;
+};
+
+// Find the maximal free rectangles whose bottom edge lies on row y, above
+// the columns [left,right) that become used there: the largest rectangles
+// of the histogram of free column heights that contain such a column
+static void FindMaximal( const ColumnMap& columns, unsigned long width, unsigned long y, unsigned long left, unsigned long right, vector<FreeArea::RECT>& found )
+{
+	// The run of free columns around [left,right)
+	ColumnMap::const_iterator first = columns.upper_bound(left);
+	--first;
+	while (first != columns.begin())
+	{
+		ColumnMap::const_iterator prev = first;
+		if ((--prev)->second >= y)
+		{
+			break;
+		}
+		first = prev;
+	}
+
+	ColumnMap::const_iterator stop = first;
+	while (stop != columns.end() && (stop->first < right || stop->second < y))
+	{
+		stop++;
+	}
+
+	vector<Bar> bars;
+	for (ColumnMap::const_iterator c = first; ; c++)
+	{
+		unsigned long x = (c == columns.end()) ? width : c->first;
+		unsigned long h = (c == stop || c->second >= y) ? 0 : y - c->second;
+
+		// Every higher bar ends here; its rectangle is as wide as it got
+		unsigned long start = x;
+		while (!bars.empty() && bars.back().h >= h)
+		{
+			Bar b = bars.back();
+			bars.pop_back();
+			if (b.h > h && b.x < right && x > left)
+			{
+				FreeArea::RECT r = { b.x, y - b.h, x - b.x, b.h };
+				found.push_back(r);
+			}
+			start = b.x;
+		}
+
+		if (c == stop)
+		{
+			break;
+		}
+		Bar bar = { start, h };
+		bars.push_back(bar);
+	}
+}
+
+void FreeArea::build( unsigned long width, unsigned long height, const vector<RECT>& used )
+{
+	clear();
+	if (width == 0 || height == 0)
+	{
+		return;
+	}
+
+	vector<BuildEvent> events;
+	events.reserve(used.size() * 2);
+	for (size_t i = 0; i < used.size(); i++)
+	{
+		const RECT& r = used[i];
+		if (r.w != 0 && r.h != 0)
+		{
+			BuildEvent start = { r.y,       true,  r.x, r.x + r.w, i };
+			BuildEvent end   = { r.y + r.h, false, r.x, r.x + r.w, i };
+			events.push_back(start);
+			events.push_back(end);
+		}
+	}
+	sort(events.begin(), events.end());
+
+	// Sweep from top to bottom. Every maximal free rectangle is blocked at the
+	// bottom by a used area that starts there, or by the bottom of the image,
+	// so they are all found exactly when the line gets there.
+	ColumnMap    columns;
+	vector<RECT> found;
+	vector<bool> skipped(used.size(), false);
+	columns[0] = 0;
+
+	for (size_t i = 0; i < events.size(); )
+	{
+		unsigned long y = events[i].y;
+		for (; i < events.size() && events[i].y == y && !events[i].start; i++)
+		{
+			if (!skipped[events[i].area])
+			{
+				SetColumns(columns, width, events[i].left, events[i].right, y);
+			}
+		}
+
+		// Look for rectangles before any of the areas that start here is
+		// marked, so rectangles above several of them are found as well
+		size_t        starts = i;
+		unsigned long right  = 0;	// Of the areas that start here so far
+		for (; i < events.size() && events[i].y == y; i++)
+		{
+			const BuildEvent& e = events[i];
+			ColumnMap::const_iterator c = columns.upper_bound(e.left);
+			--c;
+			for (; c != columns.end() && c->first < e.right; c++)
+			{
+				if (c->second == USED)
+				{
+					break;
+				}
+			}
+			if (e.left < right || (c != columns.end() && c->first < e.right))
+			{
+				// Overlaps another used area; leave it out altogether
+				skipped[e.area] = true;
+			}
+			else
+			{
+				FindMaximal(columns, width, y, e.left, e.right, found);
+				right = e.right;
+			}
+		}
+		for (; starts < i; starts++)
+		{
+			if (!skipped[events[starts].area])
+			{
+				SetColumns(columns, width, events[starts].left, events[starts].right, USED);
+			}
+		}
+	}
+	FindMaximal(columns, width, height, 0, width, found);
+
+	// List the rectangles in reading order, so getFreeArea breaks ties the
+	// same way for every image with the same used areas. A rectangle above
+	// several areas is found for each of them; keep it once.
+	sort(found.begin(), found.end(), CompareReading);
+	found.erase( unique(found.begin(), found.end(), SameRect), found.end() );
+	for (vector<RECT>::const_iterator r = found.begin(); r != found.end(); r++)
+	{
+		addRect(*r);
+	}
+}
\ No newline at end of file
@@ -5,6 +5,7 @@
 #ifndef FREEAREA_H
 #define FREEAREA_H
 
+#include <stddef.h>
 #include <vector>
 #include <stack>
 
@@ -16,18 +17,95 @@ public:
 		unsigned long x, y, w, h;
 	};
 
+	// How getFreeArea chooses among the free rectangles that can hold an area.
+	// The area is always placed in the top-left corner of the chosen rectangle.
+	enum Heuristic
+	{
+		FIRST_FIT,				// The first rectangle that fits
+		BEST_SHORT_SIDE_FIT,	// Smallest leftover along the shorter side
+		BEST_LONG_SIDE_FIT,		// Smallest leftover along the longer side
+		BEST_AREA_FIT,			// Smallest leftover area
+		BOTTOM_LEFT,			// Lowest bottom edge (in image coordinates), then leftmost
+		CONTACT_POINT			// Longest perimeter touching used space or the edges
+	};
+
 private:
+	// Uniform grid that keeps, for every cell, the indices of the rectangles
+	// that overlap it. This way, intersection and containment queries only
+	// have to look at rectangles in the neighbourhood of the query.
+	class Grid
+	{
+		static const unsigned int CELL_SHIFT = 7;	// 128x128 pixel cells
+
+		unsigned long width, height;				// Size of the grid, in cells
+		std::vector< std::vector<size_t> > cells;
+
+		void grow(unsigned long cx, unsigned long cy);
+
+	public:
+		void insert(size_t index, const RECT& rect);
+		void remove(size_t index, const RECT& rect);
+
+		// Get the rectangles overlapping the cell that contains (x,y), or NULL
+		const std::vector<size_t>* at(unsigned long x, unsigned long y) const;
+
+		// Get the rectangles overlapping the cells covered by rect.
+		// The result is sorted and contains no duplicates.
+		void query(const RECT& rect, std::vector<size_t>& result) const;
+
+		Grid();
+	};
+
+	// Free rectangles grouped by width: bucket i holds the rectangles with a
+	// width in [2^i, 2^(i+1)) along with their maximum height, so searches can
+	// skip every bucket that cannot possibly hold the requested area.
+	static const unsigned int BUCKET_COUNT = sizeof(unsigned long) * 8;
+
+	struct Bucket
+	{
+		std::vector<size_t> rects;
+		unsigned long       maxHeight;
+		bool                stale;		// maxHeight must be recomputed
+
+		Bucket() : maxHeight(0), stale(false) {}
+	};
+
 	std::vector<RECT>   Rects;
 	std::stack<size_t> Recycled;
+	Grid               Index;
+	Bucket             Buckets[BUCKET_COUNT];
+	std::vector<size_t> BucketPos;		// Position of every rectangle in its bucket
 
 	void addRect( const RECT& rect );
 	bool removeRect( const RECT& rect );
+	void killRect( size_t index );
+
+	// Add a freed rectangle, growing it and its neighbours into each other
+	// and dropping the rectangles that it makes redundant
+	void mergeRect( RECT rect );
+
+	// Drop the recycled slots once they make up most of the list
+	void compact();
+
+	// Forget all rectangles
+	void clear();
+
+	void addToBucket( size_t index );
+	void removeFromBucket( size_t index );
+	unsigned long getMaxHeight( unsigned int bucket );
+
+	// Length of the segment of the line at (x,y) (horizontal or vertical)
+	// that is covered by free rectangles
+	unsigned long getFreeLength( unsigned long x, unsigned long y, unsigned long length, bool horizontal ) const;
+
+	// Length of the perimeter of area that does not border on free space
+	unsigned long getContactLength( const RECT& area ) const;
 
 public:
 	// Get a free area of size area.width by area.height
 	// The resulting (x,y) coordinates are stored in the parameter along with the
 	// requested width and height.
-	bool getFreeArea( RECT& area );
+	bool getFreeArea( RECT& area, Heuristic heuristic = FIRST_FIT );
 
 	// Mark this area as used
 	// Returns whether the indicated area was completely unused before
@@ -35,6 +113,22 @@ public:
 
 	// Mark this area as free
 	void addFreeArea( int x, int y, int width, int height );
+
+	// Mark all these areas as free at once. Areas that line up are joined
+	// before they are merged, which is much cheaper than freeing them one
+	// by one when many neighbouring areas are released together.
+	void addFreeAreas( std::vector<RECT> areas );
+
+	// Get the free rectangles, in the order in which getFreeArea breaks ties
+	void getFreeRects( std::vector<RECT>& rects ) const;
+
+	// Start over with a width by height image in which these areas are used.
+	// The areas must not overlap. The free space is found in one sweep, which
+	// is much cheaper than marking the areas used one by one. That gives the
+	// same rectangles, but listed in reading order (top to bottom, then left
+	// to right) instead of in the order the marking left them, so where ties
+	// are broken by list position, getFreeArea can choose another one.
+	void build( unsigned long width, unsigned long height, const std::vector<RECT>& used );
 };
 
 #endif
\ No newline at end of file
@@ -104,16 +104,6 @@ static bool DoSaveFile( ApplicationInfo* info, bool saveas = false )
 			return false;
 		}
 
-		try
-		{
-			info->openfile->saveIndex(filename1);
-		}
-		catch (wexception& e)
-		{
-			MessageBox(info->hMainWnd, e.what(), NULL, MB_OK | MB_ICONHAND);
-			return false;
-		}
-
 		filter = GetFilterString( info->SupportedExtsWrite );
 		memset(&ofn, 0, sizeof(OPENFILENAME));
 		ofn.lStructSize  = sizeof(OPENFILENAME);
@@ -130,9 +120,11 @@ static bool DoSaveFile( ApplicationInfo* info, bool saveas = false )
 			return false;
 		}
 
+		// The image goes first, so the index never refers to areas that are not in it
 		try
 		{
 			info->openfile->saveImage(filename2, info->SupportedExtsWrite[ofn.nFilterIndex - 1].second.second);
+			info->openfile->saveIndex(filename1);
 		}
 		catch (wexception& e)
 		{
@@ -192,6 +184,8 @@ static void DoCloseFile( ApplicationInfo* info )
 		EnableMenuItem( GetSubMenu(hMenuBar, 0), ID_FILE_SAVE,        MF_BYCOMMAND );
 		EnableMenuItem( GetSubMenu(hMenuBar, 0), ID_FILE_SAVEAS,      MF_BYCOMMAND );
 		EnableMenuItem( GetSubMenu(hMenuBar, 1), ID_EDIT_INSERTFILE,  MF_BYCOMMAND );
+		EnableMenuItem( GetSubMenu(hMenuBar, 1), ID_EDIT_REPACK,      MF_BYCOMMAND );
+		EnableMenuItem( GetSubMenu(hMenuBar, 1), ID_EDIT_MERGEDUPLICATES, MF_BYCOMMAND );
 		EnableMenuItem( GetSubMenu(hMenuBar, 1), ID_EDIT_EXTRACTFILE, MF_BYCOMMAND | MF_GRAYED );
 		EnableMenuItem( GetSubMenu(hMenuBar, 1), ID_EDIT_RENAMEFILE,  MF_BYCOMMAND | MF_GRAYED );
 		EnableMenuItem( GetSubMenu(hMenuBar, 1), ID_EDIT_DELETEFILE,  MF_BYCOMMAND | MF_GRAYED );
@@ -291,6 +285,8 @@ static void DoOpenFile( ApplicationInfo* info )
 	EnableMenuItem( GetSubMenu(hMenuBar, 0), ID_FILE_SAVE,        MF_BYCOMMAND | (readonly ? MF_GRAYED : 0) );
 	EnableMenuItem( GetSubMenu(hMenuBar, 0), ID_FILE_SAVEAS,      MF_BYCOMMAND | (readonly ? MF_GRAYED : 0) );
 	EnableMenuItem( GetSubMenu(hMenuBar, 1), ID_EDIT_INSERTFILE,  MF_BYCOMMAND | (readonly ? MF_GRAYED : 0) );
+	EnableMenuItem( GetSubMenu(hMenuBar, 1), ID_EDIT_REPACK,      MF_BYCOMMAND | (readonly ? MF_GRAYED : 0) );
+	EnableMenuItem( GetSubMenu(hMenuBar, 1), ID_EDIT_MERGEDUPLICATES, MF_BYCOMMAND | (readonly ? MF_GRAYED : 0) );
 	EnableMenuItem( GetSubMenu(hMenuBar, 1), ID_EDIT_EXTRACTFILE, MF_BYCOMMAND | MF_GRAYED );
 	EnableMenuItem( GetSubMenu(hMenuBar, 1), ID_EDIT_RENAMEFILE,  MF_BYCOMMAND | MF_GRAYED );
 	EnableMenuItem( GetSubMenu(hMenuBar, 1), ID_EDIT_DELETEFILE,  MF_BYCOMMAND | MF_GRAYED );
@@ -487,11 +483,31 @@ static void DoExtractFiles(ApplicationInfo* info)
 		// Save them
 		try
 		{
+			vector<wstring> targets, errors;
 			for (size_t i = 0; i < files.size(); i++)
 			{
-				info->openfile->extractFile( files[i], directory + L"\\" + files[i] );
+				targets.push_back( directory + L"\\" + files[i] );
+			}
+			info->openfile->extractFiles( files, targets, errors );
+
+			// Report the files that failed, if any
+			wstring message;
+			for (size_t i = 0; i < errors.size(); i++)
+			{
+				if (!errors[i].empty())
+				{
+					message += files[i] + L": " + errors[i] + L"\n";
+				}
+			}
+
+			if (message.empty())
+			{
+				MessageBox(info->hMainWnd, LoadString(IDS_INFO_EXTRACTED).c_str(), LoadString(IDS_INFORMATION).c_str(), MB_OK | MB_ICONINFORMATION );
+			}
+			else
+			{
+				MessageBox(info->hMainWnd, message.c_str(), NULL, MB_OK | MB_ICONERROR );
 			}
-			MessageBox(info->hMainWnd, LoadString(IDS_INFO_EXTRACTED).c_str(), LoadString(IDS_INFORMATION).c_str(), MB_OK | MB_ICONINFORMATION );
 		}
 		catch (wexception& e)
 		{
@@ -551,17 +567,86 @@ static void DoSelect(ApplicationInfo* info, const wstring& name )
 	}
 }
 
+// Show the position of the selected file again, after files have moved
+static void UpdateSelectedPosition(ApplicationInfo* info)
+{
+	const FileInfo* fi = info->openfile->getSelected();
+	if (fi != NULL)
+	{
+		int values[2] = { fi->x, fi->y };
+		for (int i = 0; i < 2; i++)
+		{
+			wstringstream str;
+			str << values[i];
+			SetWindowText(info->hLabels[i], str.str().c_str() );
+		}
+		InvalidateRect(info->hRenderWnd, NULL, TRUE);
+		UpdateWindow(info->hRenderWnd);
+	}
+}
+
+// Repack the files to get rid of unused space
+static void DoRepack(ApplicationInfo* info)
+{
+	try
+	{
+		info->openfile->repack();
+	}
+	catch (wexception& e)
+	{
+		MessageBox(info->hMainWnd, e.what(), NULL, MB_OK | MB_ICONERROR );
+		return;
+	}
+
+	// The selected file has most likely moved
+	UpdateSelectedPosition(info);
+}
+
+// Let files with the same pixels share one area
+static void DoMergeDuplicates(ApplicationInfo* info)
+{
+	try
+	{
+		if (info->openfile->mergeDuplicates() == 0)
+		{
+			return;
+		}
+	}
+	catch (wexception& e)
+	{
+		MessageBox(info->hMainWnd, e.what(), NULL, MB_OK | MB_ICONERROR );
+		return;
+	}
+
+	// The selected file may be one of the merged ones
+	UpdateSelectedPosition(info);
+}
+
 // Delete the selected files
 static void DoDeleteFile(ApplicationInfo* info)
 {
-	int index;
-	while ((index = ListView_GetNextItem(info->hListView, -1, LVNI_SELECTED)) != -1)
+	vector<wstring> filenames;
+	vector<int>     indices;
+
+	int index = -1;
+	while ((index = ListView_GetNextItem(info->hListView, index, LVNI_SELECTED)) != -1)
 	{
 		TCHAR text[MAX_PATH];
 		ListView_GetItemText(info->hListView, index, 0, text, MAX_PATH );
-		info->openfile->deleteFile( text );
-		ListView_DeleteItem(info->hListView, index );
+		filenames.push_back( text );
+		indices.push_back( index );
 	}
+
+	info->openfile->deleteFiles( filenames );
+
+	// Remove the items back to front, so the other indices stay valid
+	SendMessage(info->hListView, WM_SETREDRAW, FALSE, 0);
+	for (vector<int>::reverse_iterator i = indices.rbegin(); i != indices.rend(); i++)
+	{
+		ListView_DeleteItem(info->hListView, *i );
+	}
+	SendMessage(info->hListView, WM_SETREDRAW, TRUE, 0);
+	InvalidateRect(info->hListView, NULL, TRUE);
 }
 
 INT_PTR CALLBACK MainWindowProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
@@ -671,6 +756,20 @@ INT_PTR CALLBACK MainWindowProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lPar
 							DoExtractFiles(info);
 							break;
 
+						case ID_EDIT_REPACK:
+							if (!info->openfile->isReadOnly())
+							{
+								DoRepack(info);
+							}
+							break;
+
+						case ID_EDIT_MERGEDUPLICATES:
+							if (!info->openfile->isReadOnly())
+							{
+								DoMergeDuplicates(info);
+							}
+							break;
+
 						case ID_EDIT_DELETEFILE:
                             if (!info->openfile->isReadOnly())
 							{
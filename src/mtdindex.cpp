@@ -0,0 +1,223 @@
+//
+// This file contains the conversions between the MTD index and the file map.
+//
+#include <algorithm>
+#include <map>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <wctype.h>
+
+#include "mtdindex.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+using namespace std;
+
+wstring GetIndexName(const wstring& path)
+{
+	size_t ofs = path.find_last_of(L"\\/");
+	wstring filename = path.substr((ofs != wstring::npos) ? ofs + 1 : 0, 63);
+	for (size_t i = 0; i < filename.length(); i++)
+	{
+		filename[i] = towupper(filename[i]);
+	}
+	return filename;
+}
+
+wstring DecodeIndexName(const char* name, size_t length)
+{
+	// Names are practically always plain ASCII, which maps one-on-one
+	wstring result(length, L'\0');
+	for (size_t i = 0; i < length; i++)
+	{
+		unsigned char c = (unsigned char)name[i];
+		if (c >= 0x80)
+		{
+			wchar_t wstr[64];
+#ifdef _WIN32
+			int n = MultiByteToWideChar(CP_ACP, MB_PRECOMPOSED, name, (int)length, wstr, 63);
+#else
+			char cstr[64];
+			memcpy(cstr, name, length);
+			cstr[length] = '\0';
+			size_t n = mbstowcs(wstr, cstr, 63);
+			if (n == (size_t)-1) n = 0;
+#endif
+			result.assign(wstr, n);
+			for (size_t j = 0; j < result.length(); j++)
+			{
+				result[j] = towupper(result[j]);
+			}
+			return result;
+		}
+		result[i] = (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+	}
+	return result;
+}
+
+void EncodeIndexName(const wstring& name, char output[64])
+{
+	memset(output, 0, 64);
+
+	size_t length = min(name.length(), (size_t)64);
+	for (size_t i = 0; i < length; i++)
+	{
+		if (name[i] >= 0x80)
+		{
+			memset(output, 0, 64);
+#ifdef _WIN32
+			WideCharToMultiByte(CP_ACP, WC_NO_BEST_FIT_CHARS, name.c_str(), (int)name.length(), output, 64, "_", NULL);
+#else
+			char cstr[MB_LEN_MAX];
+			for (size_t j = 0, n = 0; j < name.length(); j++)
+			{
+				int len = wctomb(cstr, name[j]);
+				if (len < 0)
+				{
+					cstr[0] = '_';
+					len = 1;
+				}
+				if (n + len > 64) break;
+				memcpy(output + n, cstr, len);
+				n += len;
+			}
+#endif
+			return;
+		}
+		output[i] = (char)name[i];
+	}
+}
+
+void SerializeIndex(const FileMap& files, vector<unsigned char>& buffer)
+{
+	buffer.resize(sizeof(uint32_t) + files.size() * sizeof(FILEINFO));
+
+	uint32_t count = htolel((uint32_t)files.size());
+	memcpy(&buffer[0], &count, sizeof count);
+
+	FILEINFO* output = (FILEINFO*)&buffer[sizeof count];
+	for (FileMap::const_iterator i = files.begin(); i != files.end(); i++, output++)
+	{
+		const FileInfo& fi = i->second;
+
+		output->x = htolel(fi.x);
+		output->y = htolel(fi.y);
+		output->w = htolel(fi.w);
+		output->h = htolel(fi.h);
+		output->used = fi.used;
+		EncodeIndexName(i->first, output->name);
+	}
+}
+
+// The name of an entry, as used in the file map
+static wstring GetEntryName(const FILEINFO& entry)
+{
+	const char* end = (const char*)memchr(entry.name, '\0', 63);
+	return DecodeIndexName(entry.name, (end != NULL) ? end - entry.name : 63);
+}
+
+// Where the area of an entry (with border) starts or ends along the x axis
+struct SweepEvent
+{
+	unsigned long x;
+	bool          start;		// Ends come before starts at the same x
+	size_t        entry;
+
+	bool operator < (const SweepEvent& e) const {
+		return (x != e.x) ? x < e.x : (start != e.start) ? !start : entry < e.entry;
+	}
+};
+
+// An area that the sweep line crosses, keyed by its top in the active map
+struct ActiveArea
+{
+	unsigned long bottom;
+	size_t        entry;
+};
+
+static bool CompareEntry(const IndexProblem& p1, const IndexProblem& p2)
+{
+	return (p1.entry != p2.entry) ? p1.entry < p2.entry : p1.other < p2.other;
+}
+
+void ValidateIndex(const FILEINFO* entries, size_t count, unsigned long width, unsigned long height, vector<IndexProblem>& problems)
+{
+	problems.clear();
+
+	// The areas, including the border, of the entries that lie inside the image
+	vector<unsigned long> left(count), top(count), right(count), bottom(count);
+	vector<SweepEvent> events;
+	events.reserve(count * 2);
+	for (size_t i = 0; i < count; i++)
+	{
+		unsigned long long x = letohl(entries[i].x), y = letohl(entries[i].y);
+		unsigned long long w = letohl(entries[i].w), h = letohl(entries[i].h);
+		if (x == 0 || y == 0 || x + w + 1 > width || y + h + 1 > height)
+		{
+			IndexProblem p = { IndexProblem::OUTSIDE_IMAGE, i, i, GetEntryName(entries[i]), wstring() };
+			problems.push_back(p);
+			continue;
+		}
+
+		left[i]   = (unsigned long)(x - 1);
+		top[i]    = (unsigned long)(y - 1);
+		right[i]  = (unsigned long)(x + w + 1);
+		bottom[i] = (unsigned long)(y + h + 1);
+
+		SweepEvent start = { left[i],  true,  i };
+		SweepEvent end   = { right[i], false, i };
+		events.push_back(start);
+		events.push_back(end);
+	}
+	sort(events.begin(), events.end());
+
+	// Sweep from left to right. The areas the line crosses never overlap, so
+	// the ones overlapping a new area are the ones right above its bottom in
+	// the active map. An area that overlaps one of them is reported and left
+	// out, and so is an alias, so that stays true.
+	map<unsigned long, ActiveArea> active;
+	vector<bool> added(count, false);
+	for (vector<SweepEvent>::const_iterator e = events.begin(); e != events.end(); e++)
+	{
+		size_t i = e->entry;
+		if (!e->start)
+		{
+			if (added[i])
+			{
+				active.erase(top[i]);
+			}
+			continue;
+		}
+
+		bool clear = true;
+		map<unsigned long, ActiveArea>::const_iterator a = active.lower_bound(bottom[i]);
+		while (a != active.begin())
+		{
+			--a;
+			if (a->second.bottom <= top[i])
+			{
+				break;
+			}
+
+			size_t j = a->second.entry;
+			clear = false;
+			if (left[j] != left[i] || top[j] != top[i] || right[j] != right[i] || bottom[j] != bottom[i])
+			{
+				IndexProblem p = { IndexProblem::OVERLAP, i, j, GetEntryName(entries[i]), GetEntryName(entries[j]) };
+				problems.push_back(p);
+			}
+		}
+
+		if (clear)
+		{
+			ActiveArea area = { bottom[i], i };
+			active.insert( make_pair(top[i], area) );
+			added[i] = true;
+		}
+	}
+
+	stable_sort(problems.begin(), problems.end(), CompareEntry);
+}
\ No newline at end of file
@@ -0,0 +1,69 @@
+//
+// This file contains the on-disk layout of the MTD index and the routines
+// that convert between it and the file map. Nothing in here depends on the
+// Win32 API, so it can be shared with other builds.
+//
+#ifndef MTDINDEX_H
+#define MTDINDEX_H
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include "types.h"
+
+struct FileInfo
+{
+	unsigned long x, y;
+	unsigned long w, h;
+	unsigned char used;
+};
+
+typedef std::map<std::wstring,FileInfo> FileMap;
+
+// One entry of the index, as stored in the file (little-endian)
+#pragma pack(1)
+struct FILEINFO
+{
+	char name[64];
+	uint32_t x, y, w, h;
+	uint8_t used;
+};
+#pragma pack()
+
+// The name under which a file is stored in the index: the uppercase
+// filename without its directory, cut off at 63 characters
+std::wstring GetIndexName(const std::wstring& path);
+
+// Convert a name from the index to the uppercase key used in the file map
+std::wstring DecodeIndexName(const char* name, size_t length);
+
+// Convert a file map key to a zero-padded index name
+void EncodeIndexName(const std::wstring& name, char output[64]);
+
+// Store the complete index (count and entries) in buffer
+void SerializeIndex(const FileMap& files, std::vector<unsigned char>& buffer);
+
+// Something wrong with an entry of an index, found by ValidateIndex
+struct IndexProblem
+{
+	enum Type
+	{
+		OUTSIDE_IMAGE,		// The area, with its border, does not fit in the image
+		OVERLAP				// The area overlaps the area of another entry
+	};
+
+	Type         type;
+	size_t       entry;			// Position of the entry in the index
+	size_t       other;			// For OVERLAP, the position of the other entry
+	std::wstring name;
+	std::wstring otherName;
+};
+
+// Check count entries of an index against a width by height image. Every
+// entry that lies outside the image or overlaps another one is reported,
+// ordered by position; aliases, with the exact same area, are fine. Takes
+// O(n log n) time for n entries, plus the number of problems.
+void ValidateIndex(const FILEINFO* entries, size_t count, unsigned long width, unsigned long height, std::vector<IndexProblem>& problems);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,673 @@
+//
+// This file contains mtdtool, the command-line front end to the MTD/TGA file
+// pairs. It does what the editor does, but without a window, so atlases can
+// be built and checked by scripts, on Windows as well as elsewhere.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <locale.h>
+#include <wchar.h>
+#include <algorithm>
+#include <exception>
+#include <string>
+#include <vector>
+
+#include "filepair.h"
+#include "atlas.h"
+#include "buildcache.h"
+#include "fileio.h"
+#include "exceptions.h"
+#include "Utils.h"
+using namespace std;
+
+// Size of the image of a new pair; it grows as files are inserted
+static const unsigned int DEFAULT_WIDTH  = 256;
+static const unsigned int DEFAULT_HEIGHT = 256;
+
+// Exit codes
+static const int EXIT_OK    = 0;
+static const int EXIT_ERROR = 1;
+static const int EXIT_USAGE = 2;
+
+#ifdef _WIN32
+static const wchar_t PATH_SEPARATOR = L'\\';
+#else
+static const wchar_t PATH_SEPARATOR = L'/';
+#endif
+
+struct Options
+{
+	FreeArea::Heuristic heuristic;
+	unsigned long       maxWidth, maxHeight;
+	bool                compaction;
+	bool                compressImage;
+	bool                lowMemory;
+	bool                syncOnSave;
+	bool                mergeDuplicates;
+	wstring             cacheFilename;	// Empty for the default
+	vector<wstring>     arguments;		// Everything that is not an option
+};
+
+static const struct
+{
+	const wchar_t*      name;
+	FreeArea::Heuristic heuristic;
+} Heuristics[] = {
+	{ L"first-fit",   FreeArea::FIRST_FIT },
+	{ L"short-side",  FreeArea::BEST_SHORT_SIDE_FIT },
+	{ L"long-side",   FreeArea::BEST_LONG_SIDE_FIT },
+	{ L"area",        FreeArea::BEST_AREA_FIT },
+	{ L"bottom-left", FreeArea::BOTTOM_LEFT },
+	{ L"contact",     FreeArea::CONTACT_POINT },
+};
+
+static void PrintUsage()
+{
+	fwprintf(stderr,
+		L"Usage: mtdtool <command> [options] <index.mtd> <image.tga> [arguments]\n"
+		L"\n"
+		L"Commands:\n"
+		L"  pack   <mtd> <tga> <file>...             Create a new pair from the files\n"
+		L"  unpack <mtd> <tga> <directory> [name]... Extract all or the named files\n"
+		L"  list   <mtd> <tga>                       List the files, their areas and pages\n"
+		L"  add    <mtd> <tga> <file>...             Insert files, replacing existing ones\n"
+		L"  remove <mtd> <tga> <name>...             Delete files\n"
+		L"  verify <mtd> <tga>                       Check the index against the image\n"
+		L"  update <mtd> <tga> <file>...             Bring the pair up to date with the files,\n"
+		L"                                           redrawing only those that changed\n"
+		L"  dedupe <mtd> <tga>                       Let files with the same pixels share an area\n"
+		L"\n"
+		L"A directory argument stands for the image files in it. Page n > 0 of the\n"
+		L"pair is kept in files with \"_n\" before the extension, like index_1.mtd.\n"
+		L"\n"
+		L"Options:\n"
+		L"  --heuristic <name>  Placement of inserted files: first-fit (default),\n"
+		L"                      short-side, long-side, area, bottom-left or contact\n"
+		L"  --max-size <w>x<h>  Never grow the image beyond this size; pack and add\n"
+		L"                      put the files that do not fit on extra pages\n"
+		L"  --compact           Move a few files to make room before growing the image\n"
+		L"  --rle               Save the image RLE-compressed\n"
+		L"  --low-memory        Decode one inserted file at a time\n"
+		L"  --sync              Flush the saved files to the disk\n"
+		L"  --merge-duplicates  Let inserted files with the same pixels as another\n"
+		L"                      file share its area\n"
+		L"  --cache <file>      Build cache of update, <mtd>.cache by default\n");
+}
+
+// Parse the options and collect the other arguments. Returns false if an
+// option is not valid.
+static bool ParseOptions( const vector<wstring>& args, Options& options )
+{
+	options.heuristic       = FreeArea::FIRST_FIT;
+	options.maxWidth        = 0;
+	options.maxHeight       = 0;
+	options.compaction      = false;
+	options.compressImage   = false;
+	options.lowMemory       = false;
+	options.syncOnSave      = false;
+	options.mergeDuplicates = false;
+
+	for (size_t i = 0; i < args.size(); i++)
+	{
+		const wstring& arg = args[i];
+		if (arg == L"--heuristic" && i + 1 < args.size())
+		{
+			size_t h = 0, count = sizeof Heuristics / sizeof Heuristics[0];
+			while (h < count && args[i + 1] != Heuristics[h].name) h++;
+			if (h == count)
+			{
+				fwprintf(stderr, L"mtdtool: unknown heuristic '%ls'\n", args[i + 1].c_str());
+				return false;
+			}
+			options.heuristic = Heuristics[h].heuristic;
+			i++;
+		}
+		else if (arg == L"--max-size" && i + 1 < args.size())
+		{
+			if (swscanf(args[i + 1].c_str(), L"%lux%lu", &options.maxWidth, &options.maxHeight) != 2 ||
+				options.maxWidth == 0 || options.maxHeight == 0)
+			{
+				fwprintf(stderr, L"mtdtool: invalid size '%ls'\n", args[i + 1].c_str());
+				return false;
+			}
+			i++;
+		}
+		else if (arg == L"--cache" && i + 1 < args.size())
+		{
+			options.cacheFilename = args[++i];
+		}
+		else if (arg == L"--compact")          options.compaction      = true;
+		else if (arg == L"--rle")              options.compressImage   = true;
+		else if (arg == L"--low-memory")       options.lowMemory       = true;
+		else if (arg == L"--sync")             options.syncOnSave      = true;
+		else if (arg == L"--merge-duplicates") options.mergeDuplicates = true;
+		else if (arg.compare(0, 2, L"--") == 0)
+		{
+			fwprintf(stderr, L"mtdtool: unknown option '%ls'\n", arg.c_str());
+			return false;
+		}
+		else
+		{
+			options.arguments.push_back(arg);
+		}
+	}
+	return true;
+}
+
+static void ApplyOptions( FilePair& pair, const Options& options )
+{
+	pair.setHeuristic(options.heuristic);
+	pair.setMaxSize(options.maxWidth, options.maxHeight);
+	pair.setCompaction(options.compaction);
+	pair.setCompressImage(options.compressImage);
+	pair.setLowMemoryInsert(options.lowMemory);
+	pair.setSyncOnSave(options.syncOnSave);
+	pair.setMergeDuplicates(options.mergeDuplicates);
+}
+
+// Expand the directories among the arguments to the image files in them
+static vector<wstring> GetInputFiles( const vector<wstring>& args, size_t first )
+{
+	vector<wstring> filenames;
+	for (size_t i = first; i < args.size(); i++)
+	{
+		vector<wstring> entries;
+		if (!ListFiles(args[i], entries))
+		{
+			filenames.push_back(args[i]);
+			continue;
+		}
+
+		for (size_t j = 0; j < entries.size(); j++)
+		{
+			if (FilePair::isImageFile(entries[j]))
+			{
+				filenames.push_back(entries[j]);
+			}
+		}
+	}
+	return filenames;
+}
+
+// Can this name from the index be used as is for a file in the target
+// directory? Names that could lead elsewhere are not.
+static bool IsPlainFilename( const wstring& name )
+{
+	return !name.empty() && name != L"." && name != L".." && name.find_first_of(L"\\/:") == wstring::npos;
+}
+
+// Files are only added to or removed from a pair with a valid index
+static bool CheckWritable( const FilePair& pair )
+{
+	if (pair.isReadOnly())
+	{
+		fwprintf(stderr, L"mtdtool: %ls: the index is corrupt, run verify for details\n", pair.getIndexFilename().c_str());
+		return false;
+	}
+	return true;
+}
+
+static bool CheckWritable( Atlas& atlas )
+{
+	bool writable = true;
+	for (size_t i = 0; i < atlas.getNumPages(); i++)
+	{
+		writable = CheckWritable(atlas.getPage(i)) && writable;
+	}
+	return writable;
+}
+
+static void SetupPage( FilePair& page, void* context )
+{
+	ApplyOptions(page, *(const Options*)context);
+}
+
+static void SetupAtlas( Atlas& atlas, const Options& options )
+{
+	atlas.setHeuristic(options.heuristic);
+	atlas.setCompaction(options.compaction);
+	atlas.setPageSetup(SetupPage, (void*)&options);
+}
+
+static int DoPack( const Options& options )
+{
+	const vector<wstring>& args = options.arguments;
+
+	// Files that do not fit within the maximum size go to the next page
+	Atlas atlas(options.maxWidth, options.maxHeight);
+	SetupAtlas(atlas, options);
+
+	vector<wstring> filenames = GetInputFiles(args, 2);
+	if (!filenames.empty())
+	{
+		atlas.insertFiles(filenames);
+	}
+	atlas.save(args[0], args[1]);
+	return EXIT_OK;
+}
+
+static int DoUnpack( const Options& options )
+{
+	const vector<wstring>& args = options.arguments;
+
+	Atlas atlas(options.maxWidth, options.maxHeight);
+	atlas.open(args[0], args[1], true);
+
+	vector<wstring> names;
+	if (args.size() > 3)
+	{
+		for (size_t i = 3; i < args.size(); i++)
+		{
+			names.push_back( GetIndexName(args[i]) );
+		}
+	}
+	else
+	{
+		for (size_t page = 0; page < atlas.getNumPages(); page++)
+		{
+			const FileMap& files = atlas.getPage(page).getFiles();
+			for (FileMap::const_iterator i = files.begin(); i != files.end(); i++)
+			{
+				names.push_back(i->first);
+			}
+		}
+	}
+
+	wstring directory = args[2];
+	if (!directory.empty() && directory[directory.length() - 1] != PATH_SEPARATOR)
+	{
+		directory += PATH_SEPARATOR;
+	}
+
+	// Extract page by page; unknown names are left to the first page to report
+	int result = EXIT_OK;
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		if (!IsPlainFilename(names[i]))
+		{
+			fwprintf(stderr, L"mtdtool: %ls: not a plain filename, skipped\n", names[i].c_str());
+			result = EXIT_ERROR;
+		}
+	}
+	for (size_t page = 0; page < atlas.getNumPages(); page++)
+	{
+		vector<wstring> pageNames, targets, errors;
+		for (size_t i = 0; i < names.size(); i++)
+		{
+			if (!IsPlainFilename(names[i]))
+			{
+				continue;
+			}
+			int found = atlas.findPage(names[i]);
+			if (found == (int)page || (found < 0 && page == 0))
+			{
+				pageNames.push_back(names[i]);
+				targets.push_back(directory + names[i]);
+			}
+		}
+		if (pageNames.empty())
+		{
+			continue;
+		}
+		atlas.getPage(page).extractFiles(pageNames, targets, errors);
+
+		for (size_t i = 0; i < errors.size(); i++)
+		{
+			if (!errors[i].empty())
+			{
+				fwprintf(stderr, L"mtdtool: %ls: %ls\n", pageNames[i].c_str(), errors[i].c_str());
+				result = EXIT_ERROR;
+			}
+		}
+	}
+	return result;
+}
+
+static int DoList( const Options& options )
+{
+	Atlas atlas(options.maxWidth, options.maxHeight);
+	atlas.open(options.arguments[0], options.arguments[1], true);
+
+	for (size_t page = 0; page < atlas.getNumPages(); page++)
+	{
+		const FileMap& files = atlas.getPage(page).getFiles();
+		for (FileMap::const_iterator i = files.begin(); i != files.end(); i++)
+		{
+			wprintf(L"%ls\t%lu\t%lu\t%lu\t%lu\t%u\n", i->first.c_str(), i->second.x, i->second.y, i->second.w, i->second.h, (unsigned int)page);
+		}
+	}
+	return EXIT_OK;
+}
+
+static int DoAdd( const Options& options )
+{
+	const vector<wstring>& args = options.arguments;
+
+	Atlas atlas(options.maxWidth, options.maxHeight);
+	atlas.open(args[0], args[1], true);
+	if (!CheckWritable(atlas))
+	{
+		return EXIT_ERROR;
+	}
+	SetupAtlas(atlas, options);
+
+	vector<wstring> filenames = GetInputFiles(args, 2);
+	if (!filenames.empty())
+	{
+		atlas.insertFiles(filenames);
+	}
+	atlas.save(args[0], args[1]);
+	return EXIT_OK;
+}
+
+static int DoRemove( const Options& options )
+{
+	const vector<wstring>& args = options.arguments;
+
+	Atlas atlas(options.maxWidth, options.maxHeight);
+	atlas.open(args[0], args[1], true);
+	if (!CheckWritable(atlas))
+	{
+		return EXIT_ERROR;
+	}
+	SetupAtlas(atlas, options);
+
+	int result = EXIT_OK;
+	vector<wstring> names;
+	for (size_t i = 2; i < args.size(); i++)
+	{
+		wstring name = GetIndexName(args[i]);
+		if (atlas.findPage(name) < 0)
+		{
+			fwprintf(stderr, L"mtdtool: %ls: not in the index\n", name.c_str());
+			result = EXIT_ERROR;
+		}
+		names.push_back(name);
+	}
+
+	try
+	{
+		atlas.deleteFiles(names);
+		atlas.save(args[0], args[1]);
+	}
+	catch (wexception& e)
+	{
+		fwprintf(stderr, L"mtdtool: %ls: %ls\n", args[0].c_str(), e.what());
+		return EXIT_ERROR;
+	}
+	return result;
+}
+
+static int DoDedupe( const Options& options )
+{
+	const vector<wstring>& args = options.arguments;
+
+	Atlas atlas(options.maxWidth, options.maxHeight);
+	atlas.open(args[0], args[1]);
+	if (!CheckWritable(atlas))
+	{
+		return EXIT_ERROR;
+	}
+	SetupAtlas(atlas, options);
+
+	// Only files on the same page can share an area
+	size_t merged = 0;
+	for (size_t i = 0; i < atlas.getNumPages(); i++)
+	{
+		merged += atlas.getPage(i).mergeDuplicates();
+	}
+	if (merged > 0)
+	{
+		atlas.save(args[0], args[1]);
+	}
+	wprintf(L"%ls: %u files merged\n", args[0].c_str(), (unsigned int)merged);
+	return EXIT_OK;
+}
+
+static int DoVerify( const Options& options )
+{
+	// Decode the whole image, so a damaged image is caught as well
+	Atlas atlas(options.maxWidth, options.maxHeight);
+	atlas.open(options.arguments[0], options.arguments[1]);
+
+	int result = EXIT_OK;
+	for (size_t page = 0; page < atlas.getNumPages(); page++)
+	{
+		const FilePair& pair = atlas.getPage(page);
+		if (pair.isReadOnly())
+		{
+			const vector<IndexProblem>& problems = pair.getIndexProblems();
+			for (size_t i = 0; i < problems.size(); i++)
+			{
+				const IndexProblem& p = problems[i];
+				if (p.type == IndexProblem::OUTSIDE_IMAGE)
+				{
+					fwprintf(stderr, L"mtdtool: %ls: entry %u (%ls) falls outside the image\n",
+						pair.getIndexFilename().c_str(), (unsigned int)p.entry, p.name.c_str());
+				}
+				else
+				{
+					fwprintf(stderr, L"mtdtool: %ls: entry %u (%ls) overlaps entry %u (%ls)\n",
+						pair.getIndexFilename().c_str(), (unsigned int)p.entry, p.name.c_str(), (unsigned int)p.other, p.otherName.c_str());
+				}
+			}
+			result = EXIT_ERROR;
+			continue;
+		}
+
+		wprintf(L"%ls: %u files\n", pair.getIndexFilename().c_str(), pair.getNumFiles());
+	}
+	return result;
+}
+
+static int DoUpdate( const Options& options )
+{
+	const vector<wstring>& args = options.arguments;
+	const wstring cacheFilename = options.cacheFilename.empty() ? args[0] + L".cache" : options.cacheFilename;
+
+	// Hash the sources; the hash decides whether a file has to be redrawn
+	vector<wstring> filenames = GetInputFiles(args, 2);
+	BuildCache sources;
+	for (size_t i = 0; i < filenames.size(); i++)
+	{
+		CacheEntry entry = {};
+		if (!HashFile(filenames[i], entry.hash))
+		{
+			fwprintf(stderr, L"mtdtool: %ls: cannot read the file\n", filenames[i].c_str());
+			return EXIT_ERROR;
+		}
+		if (!sources.insert( make_pair(GetIndexName(filenames[i]), entry) ).second)
+		{
+			fwprintf(stderr, L"mtdtool: %ls: another file has the same name in the index\n", filenames[i].c_str());
+			return EXIT_ERROR;
+		}
+	}
+
+	// The build cache describes a single page
+	if (FileExists(Atlas::getPageFilename(args[0], 1)) && FileExists(Atlas::getPageFilename(args[1], 1)))
+	{
+		fwprintf(stderr, L"mtdtool: %ls: update does not work on pairs with more than one page\n", args[0].c_str());
+		return EXIT_ERROR;
+	}
+
+	// A missing pair is created, as by pack
+	uint64_t indexHash, imageHash;
+	bool exists = HashFile(args[0], indexHash) && HashFile(args[1], imageHash);
+
+	FilePair* pair;
+	if (exists)
+	{
+		pair = new FilePair(args[0], args[1], true);
+	}
+	else
+	{
+		unsigned long width  = (options.maxWidth  != 0) ? min(options.maxWidth,  (unsigned long)DEFAULT_WIDTH)  : DEFAULT_WIDTH;
+		unsigned long height = (options.maxHeight != 0) ? min(options.maxHeight, (unsigned long)DEFAULT_HEIGHT) : DEFAULT_HEIGHT;
+		pair = new FilePair(width, height);
+	}
+
+	int result = EXIT_OK;
+	try
+	{
+		if (!CheckWritable(*pair))
+		{
+			delete pair;
+			return EXIT_ERROR;
+		}
+		ApplyOptions(*pair, options);
+
+		// The cache only says something about the pair it was written for
+		uint64_t cachedIndexHash, cachedImageHash;
+		BuildCache cache;
+		if (!exists || !ReadBuildCache(cacheFilename, cachedIndexHash, cachedImageHash, cache) ||
+			cachedIndexHash != indexHash || cachedImageHash != imageHash)
+		{
+			cache.clear();
+		}
+
+		// Files that are still where the cache put them and whose contents did
+		// not change are left alone
+		vector<wstring> changed;
+		for (size_t i = 0; i < filenames.size(); i++)
+		{
+			wstring name = GetIndexName(filenames[i]);
+			const FileInfo* fi = pair->getFileInfo(name);
+			BuildCache::const_iterator c = cache.find(name);
+			if (fi == NULL || c == cache.end() || c->second.hash != sources[name].hash ||
+				c->second.placement.x != fi->x || c->second.placement.y != fi->y ||
+				c->second.placement.w != fi->w || c->second.placement.h != fi->h)
+			{
+				changed.push_back(filenames[i]);
+			}
+		}
+
+		vector<wstring> removed;
+		const FileMap& files = pair->getFiles();
+		for (FileMap::const_iterator i = files.begin(); i != files.end(); i++)
+		{
+			if (sources.find(i->first) == sources.end())
+			{
+				removed.push_back(i->first);
+			}
+		}
+
+		if (exists && changed.empty() && removed.empty())
+		{
+			wprintf(L"%ls: up to date\n", pair->getIndexFilename().c_str());
+			delete pair;
+			return EXIT_OK;
+		}
+
+		// Deleting first leaves more room for the files that changed size
+		size_t numChanged = changed.size();
+		pair->deleteFiles(removed);
+		pair->updateFiles(changed);
+		if (exists)
+		{
+			pair->save();
+		}
+		else
+		{
+			pair->saveImage(args[1]);
+			pair->saveIndex(args[0]);
+		}
+
+		// Record the placements and the pair as it is now
+		for (BuildCache::iterator i = sources.begin(); i != sources.end(); i++)
+		{
+			i->second.placement = *pair->getFileInfo(i->first);
+		}
+		if (!HashFile(args[0], indexHash) || !HashFile(args[1], imageHash) ||
+			!WriteBuildCache(cacheFilename, indexHash, imageHash, sources, options.syncOnSave))
+		{
+			fwprintf(stderr, L"mtdtool: %ls: cannot write the build cache\n", cacheFilename.c_str());
+			result = EXIT_ERROR;
+		}
+
+		wprintf(L"%ls: %u files updated, %u removed\n", pair->getIndexFilename().c_str(), (unsigned int)numChanged, (unsigned int)removed.size());
+	}
+	catch (...)
+	{
+		delete pair;
+		throw;
+	}
+	delete pair;
+	return result;
+}
+
+static const struct
+{
+	const wchar_t* name;
+	size_t         minArguments;	// Including the MTD and TGA filename
+	int          (*run)(const Options& options);
+} Commands[] = {
+	{ L"pack",   3, DoPack   },
+	{ L"unpack", 3, DoUnpack },
+	{ L"list",   2, DoList   },
+	{ L"add",    3, DoAdd    },
+	{ L"remove", 3, DoRemove },
+	{ L"verify", 2, DoVerify },
+	{ L"update", 3, DoUpdate },
+	{ L"dedupe", 2, DoDedupe },
+};
+
+static int Run( const vector<wstring>& args )
+{
+	if (args.empty())
+	{
+		PrintUsage();
+		return EXIT_USAGE;
+	}
+
+	size_t c = 0, count = sizeof Commands / sizeof Commands[0];
+	while (c < count && args[0] != Commands[c].name) c++;
+
+	Options options;
+	if (c == count || !ParseOptions( vector<wstring>(args.begin() + 1, args.end()), options ) ||
+		options.arguments.size() < Commands[c].minArguments)
+	{
+		PrintUsage();
+		return EXIT_USAGE;
+	}
+
+	try
+	{
+		return Commands[c].run(options);
+	}
+	catch (wexception& e)
+	{
+		fwprintf(stderr, L"mtdtool: %ls\n", e.what());
+	}
+	catch (exception& e)
+	{
+		fwprintf(stderr, L"mtdtool: %s\n", e.what());
+	}
+	catch (...)
+	{
+		fwprintf(stderr, L"mtdtool: unexpected error\n");
+	}
+	return EXIT_ERROR;
+}
+
+#ifdef _WIN32
+int wmain(int argc, wchar_t* argv[])
+{
+	vector<wstring> args(argv + 1, argv + argc);
+#else
+int main(int argc, char* argv[])
+{
+	// Filenames are in the encoding of the user's locale
+	setlocale(LC_ALL, "");
+
+	vector<wstring> args;
+	for (int i = 1; i < argc; i++)
+	{
+		args.push_back( AnsiToWide(argv[i]) );
+	}
+#endif
+
+	FreeImage_Initialise();
+	int result = Run(args);
+	FreeImage_DeInitialise();
+	return result;
+}
\ No newline at end of file
@@ -0,0 +1,166 @@
+//
+// This file contains the implementation of ParallelFor on top of std::thread.
+// The threads are started on first use and then wait for the next call, so
+// a call does not pay for creating them. Workers take the next index from a
+// shared counter, so uneven items balance out by themselves.
+//
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+#include "parallel.h"
+using namespace std;
+
+unsigned int GetWorkerCount()
+{
+	unsigned int count = thread::hardware_concurrency();
+	return (count > 0) ? count : 1;
+}
+
+struct ParallelJob
+{
+	atomic<size_t> next;
+	size_t         count;
+	void (*body)(size_t index, void* context);
+	void*          context;
+};
+
+static void RunItems( ParallelJob* job )
+{
+	size_t index;
+	while ((index = job->next++) < job->count)
+	{
+		job->body(index, job->context);
+	}
+}
+
+// The threads that help the caller of ParallelFor. They run one job at a
+// time; a call made while they are busy (from a body, or from another
+// thread) is left to its caller.
+class WorkerPool
+{
+	mutex              lock;
+	condition_variable wake;		// A job was posted, or the pool is stopping
+	condition_variable done;		// A thread finished its part of the job
+	vector<thread>     threads;
+	ParallelJob*       job;
+	unsigned long      generation;	// Number of jobs posted so far
+	size_t             running;		// Threads that have not finished the job
+	bool               busy;
+	bool               stopping;
+
+	void work();
+
+public:
+	// Run the job on the threads and the calling thread. Returns false,
+	// without running anything, if the threads are busy.
+	bool run( ParallelJob& job );
+
+	WorkerPool();
+	~WorkerPool();
+};
+
+WorkerPool::WorkerPool()
+	: job(NULL), generation(0), running(0), busy(false), stopping(false)
+{
+	for (unsigned int i = 1; i < GetWorkerCount(); i++)
+	{
+		try
+		{
+			threads.push_back( thread(&WorkerPool::work, this) );
+		}
+		catch (...)
+		{
+			// Could not start another thread; make do with the ones we have
+			break;
+		}
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		lock_guard<mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (size_t i = 0; i < threads.size(); i++)
+	{
+		threads[i].join();
+	}
+}
+
+void WorkerPool::work()
+{
+	unsigned long seen = 0;
+	unique_lock<mutex> guard(lock);
+	for (;;)
+	{
+		while (!stopping && generation == seen)
+		{
+			wake.wait(guard);
+		}
+		if (stopping)
+		{
+			return;
+		}
+
+		// Every thread takes part in every job, so none can miss one
+		seen = generation;
+		ParallelJob* current = job;
+		guard.unlock();
+		RunItems(current);
+		guard.lock();
+		if (--running == 0)
+		{
+			done.notify_one();
+		}
+	}
+}
+
+bool WorkerPool::run( ParallelJob& newJob )
+{
+	unique_lock<mutex> guard(lock);
+	if (busy || threads.empty())
+	{
+		return false;
+	}
+
+	busy    = true;
+	job     = &newJob;
+	running = threads.size();
+	generation++;
+	wake.notify_all();
+	guard.unlock();
+
+	RunItems(&newJob);
+
+	guard.lock();
+	while (running > 0)
+	{
+		done.wait(guard);
+	}
+	busy = false;
+	return true;
+}
+
+void ParallelFor( size_t count, void (*body)(size_t index, void* context), void* context )
+{
+	ParallelJob job;
+	job.next    = 0;
+	job.count   = count;
+	job.body    = body;
+	job.context = context;
+
+	if (count > 1)
+	{
+		static WorkerPool pool;
+		if (pool.run(job))
+		{
+			return;
+		}
+	}
+	RunItems(&job);
+}
\ No newline at end of file
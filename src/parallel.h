@@ -0,0 +1,20 @@
+//
+// This file contains a minimal helper to spread independent work items
+// over all processor cores.
+//
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stddef.h>
+
+// Number of threads ParallelFor uses at most
+unsigned int GetWorkerCount();
+
+// Call body(index, context) once for every index in [0, count), spread over
+// the worker threads, and return when all calls are done. The calling thread
+// takes part. The threads serve one call at a time; a call made while they
+// are busy, such as one from inside body, runs on its calling thread alone.
+// body must not throw; items that can fail should record that themselves.
+void ParallelFor( size_t count, void (*body)(size_t index, void* context), void* context );
+
+#endif
\ No newline at end of file
@@ -0,0 +1,281 @@
+//
+// This file contains the pixel kernels and the selection between them.
+//
+#include <string.h>
+
+#include "pixelops.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define PIXELOPS_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SSE2_TARGET
+#define AVX2_TARGET
+#else
+#include <cpuid.h>
+#define SSE2_TARGET __attribute__((target("sse2")))
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+//
+// Scalar kernels
+//
+static void CopyScalar(uint32_t* dst, const uint32_t* src, size_t count)
+{
+	memcpy(dst, src, count * sizeof(uint32_t));
+}
+
+static void FillScalar(uint32_t* dst, uint32_t value, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		dst[i] = value;
+	}
+}
+
+#ifdef PIXELOPS_X86
+// Rows at least this long are copied with memcpy, which the C runtime
+// already vectorizes and which beats a plain loop of unaligned moves
+static const size_t MEMCPY_THRESHOLD = 32;
+
+//
+// SSE2 kernels: four pixels at a time
+//
+SSE2_TARGET static void CopySSE2(uint32_t* dst, const uint32_t* src, size_t count)
+{
+	if (count >= MEMCPY_THRESHOLD)
+	{
+		memcpy(dst, src, count * sizeof(uint32_t));
+		return;
+	}
+
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + i + 4));
+		_mm_storeu_si128((__m128i*)(dst + i), a);
+		_mm_storeu_si128((__m128i*)(dst + i + 4), b);
+	}
+	for (; i + 4 <= count; i += 4)
+	{
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_loadu_si128((const __m128i*)(src + i)));
+	}
+	for (; i < count; i++)
+	{
+		dst[i] = src[i];
+	}
+}
+
+SSE2_TARGET static void FillSSE2(uint32_t* dst, uint32_t value, size_t count)
+{
+	__m128i v = _mm_set1_epi32((int)value);
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		_mm_storeu_si128((__m128i*)(dst + i), v);
+	}
+	for (; i < count; i++)
+	{
+		dst[i] = value;
+	}
+}
+
+//
+// AVX2 kernels: eight pixels at a time
+//
+AVX2_TARGET static void CopyAVX2(uint32_t* dst, const uint32_t* src, size_t count)
+{
+	if (count >= MEMCPY_THRESHOLD)
+	{
+		memcpy(dst, src, count * sizeof(uint32_t));
+		return;
+	}
+
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i*)(src + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(src + i + 8));
+		_mm256_storeu_si256((__m256i*)(dst + i), a);
+		_mm256_storeu_si256((__m256i*)(dst + i + 8), b);
+	}
+	for (; i + 8 <= count; i += 8)
+	{
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_loadu_si256((const __m256i*)(src + i)));
+	}
+	for (; i < count; i++)
+	{
+		dst[i] = src[i];
+	}
+}
+
+AVX2_TARGET static void FillAVX2(uint32_t* dst, uint32_t value, size_t count)
+{
+	__m256i v = _mm256_set1_epi32((int)value);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		_mm256_storeu_si256((__m256i*)(dst + i), v);
+	}
+	for (; i < count; i++)
+	{
+		dst[i] = value;
+	}
+}
+
+static void CpuId(int info[4], int leaf)
+{
+#ifdef _MSC_VER
+	__cpuidex(info, leaf, 0);
+#else
+	unsigned int a, b, c, d;
+	__cpuid_count(leaf, 0, a, b, c, d);
+	info[0] = (int)a; info[1] = (int)b; info[2] = (int)c; info[3] = (int)d;
+#endif
+}
+
+// Which register sets the OS saves on a context switch
+static uint64_t GetEnabledFeatures()
+{
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	uint32_t a, d;
+	__asm__ ("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+	return ((uint64_t)d << 32) | a;
+#endif
+}
+#endif
+
+static PixelOpsLevel DetectLevel()
+{
+#ifdef PIXELOPS_X86
+	int info[4];
+	CpuId(info, 0);
+	int maxLeaf = info[0];
+
+	CpuId(info, 1);
+	if ((info[3] & (1 << 26)) == 0)
+	{
+		return PIXELOPS_SCALAR;
+	}
+
+	// AVX2 needs the instructions as well as the OS saving the YMM registers
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx     = (info[2] & (1 << 28)) != 0;
+	if (maxLeaf >= 7 && osxsave && avx && (GetEnabledFeatures() & 6) == 6)
+	{
+		CpuId(info, 7);
+		if (info[1] & (1 << 5))
+		{
+			return PIXELOPS_AVX2;
+		}
+	}
+	return PIXELOPS_SSE2;
+#else
+	return PIXELOPS_SCALAR;
+#endif
+}
+
+struct Kernels
+{
+	void (*copy)(uint32_t* dst, const uint32_t* src, size_t count);
+	void (*fill)(uint32_t* dst, uint32_t value, size_t count);
+};
+
+static const Kernels KernelTable[] =
+{
+	{ CopyScalar, FillScalar },
+#ifdef PIXELOPS_X86
+	{ CopySSE2,   FillSSE2   },
+	{ CopyAVX2,   FillAVX2   },
+#endif
+};
+
+// Picked during static initialization, before any thread can call in
+static const PixelOpsLevel SupportedLevel = DetectLevel();
+static const Kernels*      Current        = &KernelTable[SupportedLevel];
+
+PixelOpsLevel GetPixelOpsLevel()
+{
+	return SupportedLevel;
+}
+
+void SetPixelOpsLevel(PixelOpsLevel level)
+{
+	Current = &KernelTable[(level < SupportedLevel) ? level : SupportedLevel];
+}
+
+void CopyPixels(uint32_t* dst, const uint32_t* src, size_t count)
+{
+	Current->copy(dst, src, count);
+}
+
+void FillPixels(uint32_t* dst, uint32_t value, size_t count)
+{
+	Current->fill(dst, value, count);
+}
+
+void CopyRect(uint32_t* dst, ptrdiff_t dstPitch, const uint32_t* src, ptrdiff_t srcPitch, size_t w, size_t h)
+{
+	const Kernels* k = Current;
+	for (size_t y = 0; y < h; y++)
+	{
+		k->copy(dst, src, w);
+		dst = (uint32_t*)((char*)dst + dstPitch);
+		src = (const uint32_t*)((const char*)src + srcPitch);
+	}
+}
+
+void FillRect(uint32_t* dst, ptrdiff_t pitch, uint32_t value, size_t w, size_t h)
+{
+	const Kernels* k = Current;
+	for (size_t y = 0; y < h; y++)
+	{
+		k->fill(dst, value, w);
+		dst = (uint32_t*)((char*)dst + pitch);
+	}
+}
+
+void ReplicateBorder(uint32_t* pixels, ptrdiff_t pitch, size_t w, size_t h)
+{
+	if (w == 0 || h == 0)
+	{
+		return;
+	}
+
+	// The columns take one pixel per row, which no vector load helps with
+	uint32_t* row = pixels;
+	for (size_t y = 0; y < h; y++)
+	{
+		row[-1] = row[0];
+		row[w]  = row[w - 1];
+		row = (uint32_t*)((char*)row + pitch);
+	}
+
+	// The rows above and below, corners included
+	uint32_t* top    = pixels - 1;
+	uint32_t* bottom = (uint32_t*)((char*)top + (ptrdiff_t)(h - 1) * pitch);
+	Current->copy((uint32_t*)((char*)top - pitch), top, w + 2);
+	Current->copy((uint32_t*)((char*)bottom + pitch), bottom, w + 2);
+}
+
+void ReplicateRowBorder(uint32_t* row, ptrdiff_t pitch, size_t w, size_t y, size_t h)
+{
+	row[-1] = row[0];
+	row[w]  = row[w - 1];
+
+	// The first and last rows are repeated, corners included, beyond them
+	if (y == 0)
+	{
+		Current->copy((uint32_t*)((char*)row - pitch) - 1, row - 1, w + 2);
+	}
+	if (y == h - 1)
+	{
+		Current->copy((uint32_t*)((char*)row + pitch) - 1, row - 1, w + 2);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,49 @@
+//
+// This file contains the pixel kernels for the hot paths of the atlas:
+// copying rows, clearing rectangles and filling the 1px border around a
+// file. Each kernel has a scalar version and, on x86, SSE2 and AVX2
+// versions; the best one the processor supports is picked on first use.
+//
+// Rectangles are given by a pointer to their first pixel and the distance
+// in bytes to the next row, which is negative for bottom-up bitmaps.
+//
+#ifndef PIXELOPS_H
+#define PIXELOPS_H
+
+#include <stddef.h>
+#include "types.h"
+
+enum PixelOpsLevel
+{
+	PIXELOPS_SCALAR,
+	PIXELOPS_SSE2,
+	PIXELOPS_AVX2
+};
+
+// The best kernel set this processor supports
+PixelOpsLevel GetPixelOpsLevel();
+
+// Use a different kernel set (at most the supported level); for benchmarks
+void SetPixelOpsLevel(PixelOpsLevel level);
+
+// Copy count pixels; the ranges may not overlap
+void CopyPixels(uint32_t* dst, const uint32_t* src, size_t count);
+
+// Set count pixels to value
+void FillPixels(uint32_t* dst, uint32_t value, size_t count);
+
+// Copy a w by h rectangle; the rectangles may not overlap
+void CopyRect(uint32_t* dst, ptrdiff_t dstPitch, const uint32_t* src, ptrdiff_t srcPitch, size_t w, size_t h);
+
+// Set every pixel of a w by h rectangle to value
+void FillRect(uint32_t* dst, ptrdiff_t pitch, uint32_t value, size_t w, size_t h);
+
+// Fill the 1px border around the w by h image at pixels by repeating its
+// outer rows and columns, corners included
+void ReplicateBorder(uint32_t* pixels, ptrdiff_t pitch, size_t w, size_t h);
+
+// The same for an image that is filled one row at a time: fill the border
+// next to row y of h rows, pitch bytes apart, as soon as that row is done
+void ReplicateRowBorder(uint32_t* row, ptrdiff_t pitch, size_t w, size_t y, size_t h);
+
+#endif
\ No newline at end of file
@@ -1,6 +1,6 @@
 #ifndef RESOURCE_H
 #define RESOURCE_H
 
-#include "Resources\resource.en.h"
+#include "Resources/resource.en.h"
 
 #endif
\ No newline at end of file
@@ -0,0 +1,444 @@
+//
+// This file contains the TGA codec.
+//
+// RLE packets hold up to 128 pixels. Decoding lets packets cross rows, as
+// older writers do; encoding never does, as the TGA 2.0 spec asks.
+//
+#include <algorithm>
+#include <vector>
+#include <string.h>
+
+#include "tga.h"
+#include "fileio.h"
+#include "pixelops.h"
+#include "types.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TGA_SSE2
+#endif
+using namespace std;
+
+static const unsigned int HEADER_SIZE = 18;
+static const unsigned int MAX_PACKET  = 128;
+
+static inline unsigned int ReadWord(const unsigned char* p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static inline void WriteWord(unsigned char* p, unsigned long value)
+{
+	p[0] = (unsigned char)(value >> 0);
+	p[1] = (unsigned char)(value >> 8);
+}
+
+bool ReadTgaHeader(const unsigned char* data, size_t size, TgaHeader& header)
+{
+	if (size < HEADER_SIZE)
+	{
+		return false;
+	}
+
+	unsigned int type = data[2];
+	if ((type != 2 && type != 10) || data[1] > 1 || (data[16] != 24 && data[16] != 32) || (data[17] & 0x10) != 0)
+	{
+		// Not a left-to-right 24 or 32-bit truecolor image
+		return false;
+	}
+
+	header.width   = ReadWord(data + 12);
+	header.height  = ReadWord(data + 14);
+	header.bpp     = data[16];
+	header.rle     = (type == 10);
+	header.topDown = (data[17] & 0x20) != 0;
+
+	// Skip the image ID and the (unused) color map
+	header.offset = HEADER_SIZE + data[0];
+	if (data[1] != 0)
+	{
+		header.offset += ReadWord(data + 5) * ((data[7] + 7) / 8);
+	}
+	return header.width > 0 && header.height > 0 && header.offset <= size;
+}
+
+// Copy n pixels from the file to a 32-bit row
+static inline const unsigned char* CopyPixels(unsigned char* dst, const unsigned char* src, unsigned long n, unsigned int bytes)
+{
+	if (bytes == 4)
+	{
+		memcpy(dst, src, n * 4);
+		return src + n * 4;
+	}
+
+	for (unsigned long i = 0; i < n; i++, dst += 4, src += 3)
+	{
+		dst[0] = src[0];
+		dst[1] = src[1];
+		dst[2] = src[2];
+		dst[3] = 0xFF;
+	}
+	return src;
+}
+
+// Get the row that is stored r-th in the file
+static inline unsigned char* RowPointer(unsigned char* bits, size_t pitch, const TgaHeader& header, unsigned long r)
+{
+	return bits + (header.topDown ? header.height - r - 1 : r) * pitch;
+}
+
+// Fill the border next to row r (in file order), now that it is complete
+static inline void FinishRow(unsigned char* row, size_t pitch, const TgaHeader& header, unsigned long r)
+{
+	unsigned long y = header.topDown ? header.height - r - 1 : r;
+	ReplicateRowBorder((uint32_t*)row, (ptrdiff_t)pitch, header.width, y, header.height);
+}
+
+bool DecodeTga(const unsigned char* data, size_t size, const TgaHeader& header, unsigned char* bits, size_t pitch, bool border)
+{
+	const unsigned char* p   = data + header.offset;
+	const unsigned char* end = data + size;
+	unsigned int  bytes  = header.bpp / 8;
+	unsigned long width  = header.width;
+	unsigned long height = header.height;
+
+	if (!header.rle)
+	{
+		if (!CheckTgaData(data, size, header))
+		{
+			return false;
+		}
+		for (unsigned long r = 0; r < height; r++)
+		{
+			unsigned char* row = RowPointer(bits, pitch, header, r);
+			p = CopyPixels(row, p, width, bytes);
+			if (border)
+			{
+				FinishRow(row, pitch, header, r);
+			}
+		}
+		return true;
+	}
+
+	unsigned long  x = 0, r = 0;
+	unsigned char* row = RowPointer(bits, pitch, header, 0);
+	while (r < height)
+	{
+		if (p == end)
+		{
+			return false;
+		}
+
+		unsigned int  packet = *p++;
+		unsigned long count  = (packet & 0x7F) + 1;
+		if (packet & 0x80)
+		{
+			// Run of one pixel
+			if ((size_t)(end - p) < bytes)
+			{
+				return false;
+			}
+			unsigned char pixel[4] = { p[0], p[1], p[2], (unsigned char)((bytes == 4) ? p[3] : 0xFF) };
+			p += bytes;
+
+			while (count > 0 && r < height)
+			{
+				unsigned long n = min(count, width - x);
+				for (unsigned long i = 0; i < n; i++)
+				{
+					memcpy(row + (x + i) * 4, pixel, 4);
+				}
+				x += n; count -= n;
+				if (x == width)
+				{
+					if (border) FinishRow(row, pitch, header, r);
+					x = 0;
+					if (++r < height) row = RowPointer(bits, pitch, header, r);
+				}
+			}
+		}
+		else
+		{
+			// Literal pixels
+			if ((size_t)(end - p) / bytes < count)
+			{
+				return false;
+			}
+			while (count > 0 && r < height)
+			{
+				unsigned long n = min(count, width - x);
+				p = CopyPixels(row + x * 4, p, n, bytes);
+				x += n; count -= n;
+				if (x == width)
+				{
+					if (border) FinishRow(row, pitch, header, r);
+					x = 0;
+					if (++r < height) row = RowPointer(bits, pitch, header, r);
+				}
+			}
+		}
+	}
+	return true;
+}
+
+// Walk the packets of RLE data, noting where every row starts if rows is
+// not NULL. Returns false if the data is truncated.
+static bool ScanRle(const unsigned char* data, size_t size, const TgaHeader& header, vector<TgaRowStart>* rows)
+{
+	const unsigned char* p   = data + header.offset;
+	const unsigned char* end = data + size;
+	unsigned int bytes = header.bpp / 8;
+
+	// Position of the current packet in the pixel stream
+	unsigned long long pos = 0, next = 0, total = (unsigned long long)header.width * header.height;
+	unsigned long r = 0;
+	while (pos < total)
+	{
+		if (p == end)
+		{
+			return false;
+		}
+
+		unsigned int  packet = *p;
+		unsigned long count  = (packet & 0x7F) + 1;
+		size_t        length = 1 + ((packet & 0x80) ? 1 : count) * bytes;
+
+		// Note every row that starts within this packet
+		for (; rows != NULL && next < pos + count && r < header.height; r++, next += header.width)
+		{
+			(*rows)[r].offset = p - data;
+			(*rows)[r].skip   = (unsigned int)(next - pos);
+		}
+
+		if ((size_t)(end - p) < length)
+		{
+			return false;
+		}
+		p   += length;
+		pos += count;
+	}
+	return true;
+}
+
+bool CheckTgaData(const unsigned char* data, size_t size, const TgaHeader& header)
+{
+	if (!header.rle)
+	{
+		return (size - header.offset) / (header.bpp / 8) / header.width >= header.height;
+	}
+	return ScanRle(data, size, header, NULL);
+}
+
+bool IndexTgaRows(const unsigned char* data, size_t size, const TgaHeader& header, vector<TgaRowStart>& rows)
+{
+	rows.resize(header.height);
+	return ScanRle(data, size, header, &rows);
+}
+
+// Decode pixels [x, x + w) of the row that starts at p, skipping the
+// first skip pixels of the first packet
+static bool DecodeRleSpan(const unsigned char* p, const unsigned char* end, unsigned int skip, unsigned int bytes,
+                          unsigned long x, unsigned long w, unsigned char* dst)
+{
+	unsigned long pos = 0;
+	while (pos < x + w)
+	{
+		if (p == end)
+		{
+			return false;
+		}
+
+		unsigned int  packet = *p++;
+		unsigned long count  = (packet & 0x7F) + 1 - skip;
+		unsigned long from   = max(pos, x);
+		unsigned long to     = min(pos + count, x + w);
+		if (packet & 0x80)
+		{
+			if ((size_t)(end - p) < bytes)
+			{
+				return false;
+			}
+			unsigned char pixel[4] = { p[0], p[1], p[2], (unsigned char)((bytes == 4) ? p[3] : 0xFF) };
+			for (unsigned long i = from; i < to; i++)
+			{
+				memcpy(dst + (i - x) * 4, pixel, 4);
+			}
+			p += bytes;
+		}
+		else
+		{
+			if ((size_t)(end - p) / bytes < skip + count)
+			{
+				return false;
+			}
+			p += skip * bytes;
+			if (from < to)
+			{
+				CopyPixels(dst + (from - x) * 4, p + (from - pos) * bytes, to - from, bytes);
+			}
+			p += count * bytes;
+		}
+		pos += count;
+		skip = 0;
+	}
+	return true;
+}
+
+bool DecodeTgaRegion(const unsigned char* data, size_t size, const TgaHeader& header, const vector<TgaRowStart>* rows,
+                     unsigned long x, unsigned long y, unsigned long w, unsigned long h, unsigned char* bits, size_t pitch)
+{
+	if (x + w > header.width || y + h > header.height || (header.rle && (rows == NULL || rows->size() != header.height)))
+	{
+		return false;
+	}
+
+	const unsigned char* end = data + size;
+	unsigned int bytes = header.bpp / 8;
+	for (unsigned long j = 0; j < h; j++)
+	{
+		unsigned long  r   = header.topDown ? y + j : header.height - (y + j) - 1;
+		unsigned char* dst = bits + (h - j - 1) * pitch;
+		if (header.rle)
+		{
+			const TgaRowStart& start = (*rows)[r];
+			if (!DecodeRleSpan(data + start.offset, end, start.skip, bytes, x, w, dst))
+			{
+				return false;
+			}
+		}
+		else
+		{
+			unsigned long long offset = header.offset + ((unsigned long long)r * header.width + x) * bytes;
+			if (offset + (unsigned long long)w * bytes > size)
+			{
+				return false;
+			}
+			CopyPixels(dst, data + offset, w, bytes);
+		}
+	}
+	return true;
+}
+
+// Number of pixels, at most n, equal to the first one
+static unsigned long RunLength(const uint32_t* p, unsigned long n)
+{
+	unsigned long i = 1;
+#ifdef TGA_SSE2
+	__m128i first = _mm_set1_epi32((int)p[0]);
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(p + i)), first);
+		if (_mm_movemask_epi8(eq) != 0xFFFF)
+		{
+			break;
+		}
+	}
+#endif
+	while (i < n && p[i] == p[0])
+	{
+		i++;
+	}
+	return i;
+}
+
+// Number of pixels, at most n, before the first pair of equal neighbours
+static unsigned long LiteralLength(const uint32_t* p, unsigned long n)
+{
+	unsigned long i = 0;
+#ifdef TGA_SSE2
+	for (; i + 5 <= n; i += 4)
+	{
+		__m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(p + i)), _mm_loadu_si128((const __m128i*)(p + i + 1)));
+		if (_mm_movemask_epi8(eq) != 0)
+		{
+			break;
+		}
+	}
+#endif
+	while (i + 1 < n && p[i] != p[i + 1])
+	{
+		i++;
+	}
+	return (i + 1 < n) ? i : n;
+}
+
+// RLE-encode one row; returns the number of bytes stored in out
+static size_t EncodeRow(const uint32_t* row, unsigned long width, unsigned char* out)
+{
+	unsigned char* o = out;
+	for (unsigned long x = 0; x < width; )
+	{
+		unsigned long n   = min(width - x, (unsigned long)MAX_PACKET);
+		unsigned long run = RunLength(row + x, n);
+		if (run > 1)
+		{
+			*o++ = (unsigned char)(0x80 | (run - 1));
+			memcpy(o, row + x, 4);
+			o += 4;
+			x += run;
+		}
+		else
+		{
+			unsigned long literal = LiteralLength(row + x, n);
+			*o++ = (unsigned char)(literal - 1);
+			memcpy(o, row + x, literal * 4);
+			o += literal * 4;
+			x += literal;
+		}
+	}
+	return o - out;
+}
+
+bool WriteTga(OutputFile& file, const unsigned char* bits, size_t pitch, unsigned long width, unsigned long height, bool rle)
+{
+	if (width > 0xFFFF || height > 0xFFFF)
+	{
+		return false;
+	}
+
+	unsigned char header[HEADER_SIZE] = {0};
+	header[2]  = rle ? 10 : 2;
+	WriteWord(header + 12, width);
+	WriteWord(header + 14, height);
+	header[16] = 32;
+	header[17] = 0x08;		// 8 bits of alpha, bottom-up
+	if (!file.write(header, sizeof header))
+	{
+		return false;
+	}
+
+	if (!rle)
+	{
+		if (pitch == width * 4)
+		{
+			return file.write(bits, pitch * height);
+		}
+		for (unsigned long r = 0; r < height; r++)
+		{
+			if (!file.write(bits + r * pitch, width * 4))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Gather encoded rows in a buffer and write it whenever it fills up.
+	// A row never takes more than five bytes per pixel.
+	static const size_t CHUNK_SIZE = 256 * 1024;
+	vector<unsigned char> buffer(max(CHUNK_SIZE, (size_t)width * 5));
+	size_t used = 0;
+	for (unsigned long r = 0; r < height; r++)
+	{
+		if (buffer.size() - used < width * 5)
+		{
+			if (!file.write(&buffer[0], used))
+			{
+				return false;
+			}
+			used = 0;
+		}
+		used += EncodeRow((const uint32_t*)(bits + r * pitch), width, &buffer[used]);
+	}
+	return file.write(&buffer[0], used);
+}
\ No newline at end of file
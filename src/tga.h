@@ -0,0 +1,61 @@
+//
+// This file contains a small TGA codec for the images the atlas is stored
+// in: 24 and 32-bit truecolor, uncompressed or RLE. Other images are left
+// to FreeImage.
+//
+// Pixels are exchanged as 32-bit BGRA rows, starting at the bottom row,
+// which is how FreeImage lays out its bitmaps on little-endian machines.
+//
+#ifndef TGA_H
+#define TGA_H
+
+#include <stddef.h>
+#include <vector>
+
+class OutputFile;
+
+struct TgaHeader
+{
+	unsigned long width, height;
+	unsigned int  bpp;			// 24 or 32
+	bool          rle;			// Type 10 instead of type 2
+	bool          topDown;		// First row in the file is the top row
+	size_t        offset;		// Offset of the pixel data in the file
+};
+
+// Parse the header of a TGA file. Returns false if this is not an image
+// this codec can handle.
+bool ReadTgaHeader(const unsigned char* data, size_t size, TgaHeader& header);
+
+// Decode the pixel data into bits (bottom row first, pitch bytes apart).
+// With border, bits lies inside a larger image and the 1px border around
+// the pixels is filled as well, each row as soon as it is decoded.
+// Returns false if the data is truncated.
+bool DecodeTga(const unsigned char* data, size_t size, const TgaHeader& header, unsigned char* bits, size_t pitch, bool border = false);
+
+// Check that all of the pixel data is there, reading only the packet
+// headers of RLE data. DecodeTga cannot fail on data that passes.
+bool CheckTgaData(const unsigned char* data, size_t size, const TgaHeader& header);
+
+// Where a row starts in RLE data: the packet, and how many of its pixels
+// belong to the rows before it
+struct TgaRowStart
+{
+	size_t        offset;
+	unsigned int  skip;
+};
+
+// Find the start of every row (in file order) of an RLE image. Only the
+// packet headers are read. Returns false if the data is truncated.
+bool IndexTgaRows(const unsigned char* data, size_t size, const TgaHeader& header, std::vector<TgaRowStart>& rows);
+
+// Decode the w by h area at (x,y), measured from the top of the image,
+// into bits (bottom row first, pitch bytes apart). Only the rows of the
+// area are read; for RLE images, rows must hold the result of IndexTgaRows.
+bool DecodeTgaRegion(const unsigned char* data, size_t size, const TgaHeader& header, const std::vector<TgaRowStart>* rows,
+                     unsigned long x, unsigned long y, unsigned long w, unsigned long h, unsigned char* bits, size_t pitch);
+
+// Write a 32-bit bottom-up image, row by row
+bool WriteTga(OutputFile& file, const unsigned char* bits, size_t pitch, unsigned long width, unsigned long height, bool rle);
+
+#endif
\ No newline at end of file
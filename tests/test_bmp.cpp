@@ -0,0 +1,146 @@
+//
+// Tests of the BMP decoder: 24 and 32-bit images, bottom-up and top-down,
+// with the border and without, and files whose headers do not add up.
+//
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "bmp.h"
+#include "testutil.h"
+using namespace std;
+
+static void WriteLong(vector<unsigned char>& data, size_t offset, uint32_t value)
+{
+	for (int i = 0; i < 4; i++)
+	{
+		data[offset + i] = (unsigned char)(value >> (8 * i));
+	}
+}
+
+// Build a BMP file of pixels (BGRA, bottom row first). A negative height
+// stores the rows top-down.
+static vector<unsigned char> MakeBmp(const vector<uint32_t>& pixels, unsigned long width, long height, unsigned int bpp)
+{
+	unsigned long rows   = (unsigned long)labs(height);
+	size_t        stride = ((width * bpp + 31) / 32) * 4;
+
+	vector<unsigned char> data(54 + stride * rows, 0);
+	data[0] = 'B';
+	data[1] = 'M';
+	WriteLong(data, 2, (uint32_t)data.size());
+	WriteLong(data, 10, 54);
+	WriteLong(data, 14, 40);
+	WriteLong(data, 18, (uint32_t)width);
+	WriteLong(data, 22, (uint32_t)(int32_t)height);
+	data[26] = 1;
+	data[28] = (unsigned char)bpp;
+
+	for (unsigned long r = 0; r < rows; r++)
+	{
+		unsigned long  y   = (height < 0) ? rows - r - 1 : r;
+		unsigned char* row = &data[54 + r * stride];
+		for (unsigned long x = 0; x < width; x++)
+		{
+			memcpy(row + x * (bpp / 8), &pixels[y * width + x], bpp / 8);
+		}
+	}
+	return data;
+}
+
+static void TestDecode(Random& random)
+{
+	for (unsigned int bpp = 24; bpp <= 32; bpp += 8)
+	{
+		for (int topDown = 0; topDown < 2; topDown++)
+		{
+			// Widths that need every amount of row padding
+			for (unsigned long width = 1; width <= 5; width++)
+			{
+				unsigned long height = 1 + random.below(6);
+				vector<uint32_t> pixels(width * height);
+				for (size_t i = 0; i < pixels.size(); i++)
+				{
+					pixels[i] = random.next() | (bpp == 24 ? 0xFF000000 : 0);
+				}
+
+				vector<unsigned char> data = MakeBmp(pixels, width, topDown ? -(long)height : (long)height, bpp);
+				BmpHeader header;
+				CHECK(ReadBmpHeader(&data[0], data.size(), header));
+				CHECK(header.width == width && header.height == height && header.bpp == bpp && header.topDown == (topDown != 0));
+
+				vector<uint32_t> bits(width * height);
+				CHECK(DecodeBmp(&data[0], data.size(), header, (unsigned char*)&bits[0], width * 4));
+				CHECK(bits == pixels);
+
+				// With the border, inside a larger image
+				vector<uint32_t> large((width + 2) * (height + 2));
+				CHECK(DecodeBmp(&data[0], data.size(), header, (unsigned char*)&large[width + 3], (width + 2) * 4, true));
+				bool same = true;
+				for (long y = -1; y <= (long)height; y++)
+				{
+					for (long x = -1; x <= (long)width; x++)
+					{
+						long sx = min(max(x, 0L), (long)width - 1);
+						long sy = min(max(y, 0L), (long)height - 1);
+						same = same && large[(y + 1) * (width + 2) + (x + 1)] == pixels[sy * width + sx];
+					}
+				}
+				CHECK(same);
+
+				// A missing byte loses the last row
+				CHECK(!DecodeBmp(&data[0], data.size() - 1, header, (unsigned char*)&bits[0], width * 4));
+			}
+		}
+	}
+}
+
+static void TestHostile()
+{
+	vector<uint32_t> pixels(4 * 4);
+	vector<unsigned char> data = MakeBmp(pixels, 4, 4, 32);
+	BmpHeader header;
+	CHECK(ReadBmpHeader(&data[0], data.size(), header));
+
+	// A width whose row size does not fit in 32 bits must not wrap around
+	// to a small stride
+	vector<unsigned char> wide = data;
+	WriteLong(wide, 18, 0x40000000);
+	CHECK(!ReadBmpHeader(&wide[0], wide.size(), header));
+	WriteLong(wide, 18, 0x7FFFFFFF);
+	CHECK(!ReadBmpHeader(&wide[0], wide.size(), header));
+
+	// Pixel data that starts past the end of the file
+	vector<unsigned char> offset = data;
+	WriteLong(offset, 10, 0xFFFFFFF0);
+	CHECK(!ReadBmpHeader(&offset[0], offset.size(), header));
+
+	// A tall image in a short file has a header, but not the rows
+	vector<unsigned char> tall = data;
+	WriteLong(tall, 22, 0x10000000);
+	if (ReadBmpHeader(&tall[0], tall.size(), header))
+	{
+		CHECK(!DecodeBmp(&tall[0], tall.size(), header, (unsigned char*)&pixels[0], 16));
+	}
+
+	// Formats left to FreeImage
+	vector<unsigned char> other = data;
+	other[28] = 8;
+	CHECK(!ReadBmpHeader(&other[0], other.size(), header));
+	other = data;
+	other[30] = 1;		// RLE8
+	CHECK(!ReadBmpHeader(&other[0], other.size(), header));
+	other = data;
+	WriteLong(other, 22, 0x80000000);
+	CHECK(!ReadBmpHeader(&other[0], other.size(), header));
+	CHECK(!ReadBmpHeader(&data[0], 53, header));
+}
+
+int main()
+{
+	Random random(7);
+	TestDecode(random);
+	TestHostile();
+	return TestResult();
+}
\ No newline at end of file
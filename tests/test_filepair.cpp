@@ -0,0 +1,169 @@
+//
+// Tests of FilePair that need FreeImage: inserting a batch with a damaged
+// TGA or BMP file in it must leave the pair exactly as it was, even when
+// the rest of the batch would have grown the image.
+//
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "filepair.h"
+#include "fileio.h"
+#include "tga.h"
+#include "exceptions.h"
+#include "testutil.h"
+using namespace std;
+
+static vector<unsigned char> ReadAll(const wstring& filename)
+{
+	MappedFile file;
+	if (!file.open(filename) || file.size() == 0)
+	{
+		return vector<unsigned char>();
+	}
+	return vector<unsigned char>(file.data(), file.data() + file.size());
+}
+
+// Write a w by h TGA file of one color, leaving off the last cut bytes
+static void WriteTestTga(const wstring& filename, unsigned long w, unsigned long h, uint32_t color, bool rle, size_t cut)
+{
+	vector<uint32_t> pixels(w * h, color);
+	if (rle && w > 1)
+	{
+		// Some literals as well as runs
+		pixels[0] ^= 0x00FFFFFF;
+	}
+
+	OutputFile file;
+	CHECK(file.create(filename));
+	CHECK(WriteTga(file, (const unsigned char*)&pixels[0], w * 4, w, h, rle));
+	file.close();
+
+	if (cut > 0)
+	{
+		vector<unsigned char> data = ReadAll(filename);
+		CHECK(file.create(filename));
+		CHECK(file.write(&data[0], data.size() - cut));
+		file.close();
+	}
+}
+
+// Write a 32-bit BMP file of one color, leaving off the last cut bytes
+static void WriteTestBmp(const wstring& filename, unsigned long w, unsigned long h, uint32_t color, size_t cut)
+{
+	vector<unsigned char> data(54 + w * h * 4, 0);
+	uint32_t header[] = { (uint32_t)data.size(), 0, 54, 40, (uint32_t)w, (uint32_t)h };
+	data[0] = 'B';
+	data[1] = 'M';
+	for (size_t i = 0; i < sizeof header / sizeof header[0]; i++)
+	{
+		for (int b = 0; b < 4; b++)
+		{
+			data[2 + i * 4 + b] = (unsigned char)(header[i] >> (8 * b));
+		}
+	}
+	data[26] = 1;
+	data[28] = 32;
+	for (size_t i = 0; i < w * h; i++)
+	{
+		memcpy(&data[54 + i * 4], &color, 4);
+	}
+
+	OutputFile file;
+	CHECK(file.create(filename));
+	CHECK(file.write(&data[0], data.size() - cut));
+	file.close();
+}
+
+static bool SameFiles(const FileMap& a, const FileMap& b)
+{
+	if (a.size() != b.size())
+	{
+		return false;
+	}
+	for (FileMap::const_iterator i = a.begin(), j = b.begin(); i != a.end(); i++, j++)
+	{
+		if (i->first != j->first || i->second.x != j->second.x || i->second.y != j->second.y ||
+			i->second.w != j->second.w || i->second.h != j->second.h)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Insert the batch, which must fail, and check nothing changed
+static void CheckFailedInsert(FilePair& pair, vector<wstring> batch)
+{
+	FileMap before = pair.getFiles();
+	pair.saveImage(L"test_filepair_before.tga");
+	vector<unsigned char> image = ReadAll(L"test_filepair_before.tga");
+
+	bool thrown = false;
+	try
+	{
+		pair.insertFiles(batch);
+	}
+	catch (wexception&)
+	{
+		thrown = true;
+	}
+	CHECK(thrown);
+	CHECK(SameFiles(before, pair.getFiles()));
+
+	pair.saveImage(L"test_filepair_after.tga");
+	CHECK(image == ReadAll(L"test_filepair_after.tga"));
+}
+
+static void TestCorruptInsert(bool lowMemory)
+{
+	WriteTestTga(L"test_a.tga", 20, 10, 0xFF102030, false, 0);
+	WriteTestTga(L"test_b.tga", 12, 30, 0xFF405060, true, 0);
+	WriteTestTga(L"test_big.tga", 100, 90, 0xFF708090, true, 0);
+	WriteTestTga(L"test_raw.tga", 16, 16, 0xFFA0B0C0, false, 7);
+	WriteTestTga(L"test_rle.tga", 16, 16, 0xFFA0B0C0, true, 1);
+	WriteTestBmp(L"test_bmp.bmp", 16, 16, 0xFFA0B0C0, 5);
+
+	FilePair pair(64, 64);
+	pair.setLowMemoryInsert(lowMemory);
+	vector<wstring> start;
+	start.push_back(L"test_a.tga");
+	start.push_back(L"test_b.tga");
+	pair.insertFiles(start);
+	CHECK(pair.getNumFiles() == 2);
+
+	// The large file would grow the image and a new test_a.tga would replace
+	// the old one, but the damaged file comes after them
+	const wchar_t* damaged[] = { L"test_raw.tga", L"test_rle.tga", L"test_bmp.bmp" };
+	for (size_t i = 0; i < sizeof damaged / sizeof damaged[0]; i++)
+	{
+		vector<wstring> batch;
+		batch.push_back(L"test_big.tga");
+		batch.push_back(L"test_a.tga");
+		batch.push_back(damaged[i]);
+		CheckFailedInsert(pair, batch);
+	}
+
+	// The pair still works
+	vector<wstring> batch(1, L"test_big.tga");
+	pair.insertFiles(batch);
+	CHECK(pair.getNumFiles() == 3);
+
+	const wchar_t* temporary[] = {
+		L"test_a.tga", L"test_b.tga", L"test_big.tga", L"test_raw.tga", L"test_rle.tga", L"test_bmp.bmp",
+		L"test_filepair_before.tga", L"test_filepair_after.tga"
+	};
+	for (size_t i = 0; i < sizeof temporary / sizeof temporary[0]; i++)
+	{
+		RemoveFile(temporary[i]);
+	}
+}
+
+int main()
+{
+	FreeImage_Initialise();
+	TestCorruptInsert(false);
+	TestCorruptInsert(true);
+	FreeImage_DeInitialise();
+	return TestResult();
+}
\ No newline at end of file
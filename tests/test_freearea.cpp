@@ -0,0 +1,332 @@
+//
+// Tests of the free rectangle administration. FreeArea::build must find the
+// same rectangles as marking the used areas one by one, in reading order.
+// After addUsedArea, addFreeArea (and so mergeRect), addFreeAreas and
+// getFreeArea, the free rectangles must still cover exactly the pixels that
+// are not used, and none of them may hold another. Freed tiles must merge
+// back into larger rectangles.
+//
+#include <algorithm>
+#include <vector>
+
+#include "freearea.h"
+#include "testutil.h"
+using namespace std;
+
+typedef FreeArea::RECT RECT;
+
+static bool Less(const RECT& a, const RECT& b)
+{
+	if (a.y != b.y) return a.y < b.y;
+	if (a.x != b.x) return a.x < b.x;
+	if (a.w != b.w) return a.w < b.w;
+	return a.h < b.h;
+}
+
+static bool Same(const RECT& a, const RECT& b)
+{
+	return a.x == b.x && a.y == b.y && a.w == b.w && a.h == b.h;
+}
+
+static bool Contains(const RECT& outer, const RECT& inner)
+{
+	return inner.x >= outer.x && inner.x + inner.w <= outer.x + outer.w &&
+	       inner.y >= outer.y && inner.y + inner.h <= outer.y + outer.h;
+}
+
+// Which pixels of the image are used
+class UsedMap
+{
+	unsigned long width, height;
+	vector<bool>  used;
+
+public:
+	bool isFree(const RECT& r) const
+	{
+		for (unsigned long y = r.y; y < r.y + r.h; y++)
+		{
+			for (unsigned long x = r.x; x < r.x + r.w; x++)
+			{
+				if (used[y * width + x]) return false;
+			}
+		}
+		return true;
+	}
+
+	void mark(const RECT& r, bool value)
+	{
+		for (unsigned long y = r.y; y < r.y + r.h; y++)
+		{
+			for (unsigned long x = r.x; x < r.x + r.w; x++)
+			{
+				used[y * width + x] = value;
+			}
+		}
+	}
+
+	// Check that the free rectangles cover exactly the unused pixels and
+	// that none of them holds another
+	bool matches(const vector<RECT>& rects) const
+	{
+		vector<bool> covered(used.size(), false);
+		for (size_t i = 0; i < rects.size(); i++)
+		{
+			const RECT& r = rects[i];
+			if (r.w == 0 || r.h == 0 || r.x + r.w > width || r.y + r.h > height || !isFree(r))
+			{
+				return false;
+			}
+			for (unsigned long y = r.y; y < r.y + r.h; y++)
+			{
+				for (unsigned long x = r.x; x < r.x + r.w; x++)
+				{
+					covered[y * width + x] = true;
+				}
+			}
+			for (size_t j = 0; j < rects.size(); j++)
+			{
+				if (j != i && Contains(rects[j], r) && (!Same(rects[j], r) || j < i))
+				{
+					return false;
+				}
+			}
+		}
+		for (size_t i = 0; i < used.size(); i++)
+		{
+			if (covered[i] == used[i])
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	UsedMap(unsigned long width, unsigned long height) : width(width), height(height), used(width * height, false) {}
+};
+
+// Random areas that do not overlap: scattered ones, or tiles that line up
+static vector<RECT> MakeUsed(Random& random, unsigned long width, unsigned long height, UsedMap& map)
+{
+	vector<RECT> used;
+	if (random.below(3) == 0)
+	{
+		unsigned long tw = 1 + random.below(6) + width / 40, th = 1 + random.below(6) + height / 40;
+		for (unsigned long y = 0; y + th <= height; y += th)
+		{
+			for (unsigned long x = 0; x + tw <= width; x += tw)
+			{
+				if (random.below(4) != 0)
+				{
+					RECT r = { x, y, tw, th };
+					used.push_back(r);
+				}
+			}
+		}
+	}
+	else
+	{
+		size_t tries = random.below(60 + width + height);
+		for (size_t i = 0; i < tries; i++)
+		{
+			RECT r;
+			r.w = 1 + random.below(min(width, 16UL));
+			r.h = 1 + random.below(min(height, 16UL));
+			r.x = random.below(width - r.w + 1);
+			r.y = random.below(height - r.h + 1);
+			if (map.isFree(r))
+			{
+				map.mark(r, true);
+				used.push_back(r);
+			}
+		}
+		return used;
+	}
+
+	for (size_t i = 0; i < used.size(); i++)
+	{
+		map.mark(used[i], true);
+	}
+	return used;
+}
+
+// Mark the areas used in a free width by height image
+static void MarkUsed(FreeArea& area, unsigned long width, unsigned long height, const vector<RECT>& used)
+{
+	area.addFreeArea(0, 0, (int)width, (int)height);
+	for (size_t i = 0; i < used.size(); i++)
+	{
+		area.addUsedArea((int)used[i].x, (int)used[i].y, (int)used[i].w, (int)used[i].h);
+	}
+}
+
+// Fill up what is left; every area handed out must have been free
+static void FillUp(Random& random, FreeArea& area, UsedMap& map, unsigned long width, unsigned long height)
+{
+	static const FreeArea::Heuristic Heuristics[] = {
+		FreeArea::FIRST_FIT, FreeArea::BEST_SHORT_SIDE_FIT, FreeArea::BEST_AREA_FIT, FreeArea::BOTTOM_LEFT, FreeArea::CONTACT_POINT
+	};
+	for (int i = 0; i < 200; i++)
+	{
+		RECT r = { 0, 0, 1 + random.below(12), 1 + random.below(12) };
+		if (area.getFreeArea(r, Heuristics[random.below(sizeof Heuristics / sizeof Heuristics[0])]))
+		{
+			CHECK(r.x + r.w <= width && r.y + r.h <= height && map.isFree(r));
+			map.mark(r, true);
+		}
+	}
+
+	vector<RECT> rects;
+	area.getFreeRects(rects);
+	CHECK(map.matches(rects));
+}
+
+static void TestMark(Random& random)
+{
+	for (int round = 0; round < 300; round++)
+	{
+		// The larger images span several cells of the grid
+		unsigned long size = (round % 10 == 0) ? 400 : 80;
+		unsigned long width = 1 + random.below(size), height = 1 + random.below(size);
+		UsedMap map(width, height);
+		vector<RECT> used = MakeUsed(random, width, height, map);
+
+		FreeArea area;
+		MarkUsed(area, width, height, used);
+
+		vector<RECT> rects;
+		area.getFreeRects(rects);
+		CHECK(map.matches(rects));
+
+		FillUp(random, area, map, width, height);
+	}
+}
+
+static void TestFree(Random& random)
+{
+	for (int round = 0; round < 300; round++)
+	{
+		unsigned long width = 1 + random.below(80), height = 1 + random.below(80);
+		UsedMap map(width, height);
+		vector<RECT> used = MakeUsed(random, width, height, map);
+
+		FreeArea area;
+		MarkUsed(area, width, height, used);
+		FreeArea together = area;
+
+		// Free about half of the areas again, one by one and all at once
+		vector<RECT> released;
+		for (size_t i = 0; i < used.size(); i++)
+		{
+			if (random.below(2) == 0)
+			{
+				released.push_back(used[i]);
+			}
+		}
+		for (size_t i = 0; i < released.size(); i++)
+		{
+			area.addFreeArea((int)released[i].x, (int)released[i].y, (int)released[i].w, (int)released[i].h);
+			map.mark(released[i], false);
+		}
+		together.addFreeAreas(released);
+
+		vector<RECT> rects;
+		area.getFreeRects(rects);
+		CHECK(map.matches(rects));
+		together.getFreeRects(rects);
+		CHECK(map.matches(rects));
+
+		UsedMap copy = map;
+		FillUp(random, area, map, width, height);
+		FillUp(random, together, copy, width, height);
+	}
+}
+
+// Tiles freed one after the other, in reading order or the other way
+// around, or in batches, must merge back into the whole image
+static void TestFreeAll(Random& random)
+{
+	for (int round = 0; round < 200; round++)
+	{
+		unsigned long tw = 1 + random.below(8), th = 1 + random.below(8);
+		unsigned long width = tw * (1 + random.below(12)), height = th * (1 + random.below(12));
+		vector<RECT> used;
+		for (unsigned long y = 0; y < height; y += th)
+		{
+			for (unsigned long x = 0; x < width; x += tw)
+			{
+				RECT r = { x, y, tw, th };
+				used.push_back(r);
+			}
+		}
+
+		FreeArea area;
+		MarkUsed(area, width, height, used);
+		FreeArea together = area;
+		if (round % 2 != 0)
+		{
+			reverse(used.begin(), used.end());
+		}
+		for (size_t i = 0; i < used.size(); i++)
+		{
+			area.addFreeArea((int)used[i].x, (int)used[i].y, (int)used[i].w, (int)used[i].h);
+		}
+
+		// In two batches; the second must merge with the first
+		vector<RECT>::iterator middle = used.begin() + random.below(used.size() + 1);
+		together.addFreeAreas(vector<RECT>(used.begin(), middle));
+		together.addFreeAreas(vector<RECT>(middle, used.end()));
+
+		vector<RECT> rects;
+		RECT whole = { 0, 0, width, height };
+		area.getFreeRects(rects);
+		CHECK(rects.size() == 1 && Same(rects[0], whole));
+		together.getFreeRects(rects);
+		CHECK(rects.size() == 1 && Same(rects[0], whole));
+	}
+}
+
+static void TestBuild(Random& random)
+{
+	for (int round = 0; round < 300; round++)
+	{
+		unsigned long size = (round % 25 == 0) ? 400 : 80;
+		unsigned long width = 1 + random.below(size), height = 1 + random.below(size);
+		UsedMap map(width, height);
+		vector<RECT> used = MakeUsed(random, width, height, map);
+
+		FreeArea built;
+		built.build(width, height, used);
+
+		FreeArea marked;
+		MarkUsed(marked, width, height, used);
+
+		vector<RECT> fromBuild, fromMarking;
+		built.getFreeRects(fromBuild);
+		marked.getFreeRects(fromMarking);
+		CHECK(map.matches(fromBuild));
+
+		// In reading order, without duplicates
+		bool ordered = true;
+		for (size_t i = 1; i < fromBuild.size(); i++)
+		{
+			ordered = ordered && Less(fromBuild[i - 1], fromBuild[i]);
+		}
+		CHECK(ordered);
+
+		// The same rectangles, possibly in another order
+		sort(fromMarking.begin(), fromMarking.end(), Less);
+		CHECK(fromBuild.size() == fromMarking.size() && equal(fromBuild.begin(), fromBuild.end(), fromMarking.begin(), Same));
+
+		FillUp(random, built, map, width, height);
+	}
+}
+
+int main()
+{
+	Random random(99);
+	TestMark(random);
+	TestFree(random);
+	TestFreeAll(random);
+	TestBuild(random);
+	return TestResult();
+}
\ No newline at end of file
@@ -0,0 +1,142 @@
+//
+// Tests of ValidateIndex against a brute-force check of every pair of
+// entries, on random indexes with entries that stick out of the image,
+// overlap each other or are aliases of another entry.
+//
+#include <stdio.h>
+#include <string.h>
+#include <set>
+#include <vector>
+
+#include "mtdindex.h"
+#include "testutil.h"
+using namespace std;
+
+static const unsigned long WIDTH  = 64;
+static const unsigned long HEIGHT = 48;
+
+static FILEINFO MakeEntry(unsigned int number, unsigned long x, unsigned long y, unsigned long w, unsigned long h)
+{
+	FILEINFO entry;
+	memset(&entry, 0, sizeof entry);
+	sprintf(entry.name, "F%03u.TGA", number);
+	entry.x    = htolel((uint32_t)x);
+	entry.y    = htolel((uint32_t)y);
+	entry.w    = htolel((uint32_t)w);
+	entry.h    = htolel((uint32_t)h);
+	entry.used = 1;
+	return entry;
+}
+
+// Does the area, with its border, fit in the image?
+static bool Inside(const FILEINFO& e)
+{
+	unsigned long x = letohl(e.x), y = letohl(e.y), w = letohl(e.w), h = letohl(e.h);
+	return x >= 1 && y >= 1 && x + w + 1 <= WIDTH && y + h + 1 <= HEIGHT;
+}
+
+// Do the areas, with their borders, overlap without being the same?
+static bool Overlap(const FILEINFO& a, const FILEINFO& b)
+{
+	unsigned long ax = letohl(a.x), ay = letohl(a.y), aw = letohl(a.w), ah = letohl(a.h);
+	unsigned long bx = letohl(b.x), by = letohl(b.y), bw = letohl(b.w), bh = letohl(b.h);
+	if (ax == bx && ay == by && aw == bw && ah == bh)
+	{
+		return false;
+	}
+	return ax - 1 < bx + bw + 1 && bx - 1 < ax + aw + 1 &&
+	       ay - 1 < by + bh + 1 && by - 1 < ay + ah + 1;
+}
+
+static void Check(const vector<FILEINFO>& entries)
+{
+	vector<IndexProblem> problems;
+	ValidateIndex(entries.empty() ? NULL : &entries[0], entries.size(), WIDTH, HEIGHT, problems);
+
+	set<size_t> outside, reported;
+	for (size_t i = 0; i < problems.size(); i++)
+	{
+		const IndexProblem& p = problems[i];
+		CHECK(p.entry < entries.size() && p.other < entries.size());
+		CHECK(i == 0 || problems[i - 1].entry <= p.entry);
+		CHECK(p.name == DecodeIndexName(entries[p.entry].name, strlen(entries[p.entry].name)));
+		if (p.type == IndexProblem::OUTSIDE_IMAGE)
+		{
+			CHECK(!Inside(entries[p.entry]));
+			outside.insert(p.entry);
+		}
+		else
+		{
+			// Only real overlaps are reported
+			CHECK(Inside(entries[p.entry]) && Inside(entries[p.other]));
+			CHECK(Overlap(entries[p.entry], entries[p.other]));
+			CHECK(p.otherName == DecodeIndexName(entries[p.other].name, strlen(entries[p.other].name)));
+		}
+		reported.insert(p.entry);
+	}
+
+	bool anyOverlap = false;
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		// Every entry outside the image is reported as such
+		CHECK(Inside(entries[i]) == (outside.count(i) == 0));
+		for (size_t j = i + 1; j < entries.size(); j++)
+		{
+			if (Inside(entries[i]) && Inside(entries[j]) && Overlap(entries[i], entries[j]))
+			{
+				anyOverlap = true;
+
+				// The entries that are left can be trusted: at least one of
+				// every overlapping pair is reported
+				CHECK(reported.count(i) != 0 || reported.count(j) != 0);
+			}
+		}
+	}
+	CHECK(anyOverlap == (problems.size() > outside.size()));
+}
+
+int main()
+{
+	Random random(31);
+
+	Check(vector<FILEINFO>());
+
+	for (int round = 0; round < 2000; round++)
+	{
+		size_t count = 1 + random.below(round < 1000 ? 8 : 40);
+		vector<FILEINFO> entries;
+		for (size_t i = 0; i < count; i++)
+		{
+			if (!entries.empty() && random.below(6) == 0)
+			{
+				// An alias of an earlier entry
+				FILEINFO alias = entries[random.below(entries.size())];
+				sprintf(alias.name, "F%03u.TGA", (unsigned int)i);
+				entries.push_back(alias);
+				continue;
+			}
+			unsigned long w = 1 + random.below(12), h = 1 + random.below(12);
+			entries.push_back( MakeEntry((unsigned int)i, random.below(WIDTH - 2), random.below(HEIGHT - 2), w, h) );
+		}
+		Check(entries);
+	}
+
+	// Areas side by side, with one pixel of border each, are fine
+	vector<FILEINFO> grid;
+	for (unsigned long y = 1; y + 7 <= HEIGHT; y += 7)
+	{
+		for (unsigned long x = 1; x + 6 <= WIDTH; x += 6)
+		{
+			grid.push_back( MakeEntry((unsigned int)grid.size(), x, y, 4, 5) );
+		}
+	}
+	vector<IndexProblem> problems;
+	ValidateIndex(&grid[0], grid.size(), WIDTH, HEIGHT, problems);
+	CHECK(problems.empty());
+
+	// One pixel closer, the borders overlap
+	grid.push_back( MakeEntry((unsigned int)grid.size(), 6, 1, 4, 5) );
+	ValidateIndex(&grid[0], grid.size(), WIDTH, HEIGHT, problems);
+	CHECK(problems.size() == 1 && problems[0].type == IndexProblem::OVERLAP && problems[0].entry == grid.size() - 1);
+	return TestResult();
+}
\ No newline at end of file
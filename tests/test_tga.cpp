@@ -0,0 +1,344 @@
+//
+// Tests of the TGA codec: WriteTga against a plain reference encoder, so
+// the SSE2 run and literal detectors are held to the scalar rules, and
+// DecodeTga, IndexTgaRows and DecodeTgaRegion against the pixels that went
+// into images of every kind the codec reads, including RLE packets that
+// run on into the next row.
+//
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "tga.h"
+#include "fileio.h"
+#include "testutil.h"
+using namespace std;
+
+static const wchar_t* TEMP_FILE = L"test_tga.tmp";
+
+// An image as the codec exchanges it: rows of BGRA pixels, bottom row first
+struct Image
+{
+	unsigned long    width, height;
+	vector<uint32_t> pixels;
+
+	uint32_t at(unsigned long x, unsigned long y) const { return pixels[y * width + x]; }
+};
+
+// Lengths of runs and literals, around the packet size and the SSE2 width
+static const unsigned long Lengths[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 15, 16, 17, 31, 32, 33, 127, 128, 129, 130, 257 };
+
+static Image MakeImage(Random& random, unsigned long width, unsigned long height, bool opaque)
+{
+	Image image;
+	image.width  = width;
+	image.height = height;
+	image.pixels.resize(width * height);
+
+	for (unsigned long y = 0; y < height; y++)
+	{
+		uint32_t* row = &image.pixels[y * width];
+		bool few = (random.below(4) == 0);		// Few colors: many short runs
+		for (unsigned long x = 0; x < width; )
+		{
+			unsigned long n = min(Lengths[random.below(sizeof Lengths / sizeof Lengths[0])], width - x);
+			bool run = (random.below(2) == 0);
+			uint32_t value = random.next();
+			for (unsigned long i = 0; i < n; i++, x++)
+			{
+				row[x] = few ? random.below(3) : run ? value : random.next();
+			}
+		}
+	}
+
+	if (opaque)
+	{
+		for (size_t i = 0; i < image.pixels.size(); i++)
+		{
+			image.pixels[i] |= 0xFF000000;
+		}
+	}
+	return image;
+}
+
+static void AppendPixel(vector<unsigned char>& out, uint32_t pixel, unsigned int bytes)
+{
+	for (unsigned int i = 0; i < bytes; i++)
+	{
+		out.push_back((unsigned char)(pixel >> (8 * i)));
+	}
+}
+
+// The RLE encoding WriteTga is expected to produce, written the slow way:
+// a run of two or more equal pixels becomes a run packet, everything up to
+// the next such run a raw packet
+static void EncodeReference(const uint32_t* p, size_t count, unsigned int bytes, vector<unsigned char>& out)
+{
+	for (size_t x = 0; x < count; )
+	{
+		size_t n   = min(count - x, (size_t)128);
+		size_t run = 1;
+		while (run < n && p[x + run] == p[x])
+		{
+			run++;
+		}
+
+		if (run > 1)
+		{
+			out.push_back((unsigned char)(0x80 | (run - 1)));
+			AppendPixel(out, p[x], bytes);
+			x += run;
+			continue;
+		}
+
+		size_t literal = 1;
+		while (literal < n && (literal + 1 == n || p[x + literal] != p[x + literal + 1]))
+		{
+			literal++;
+		}
+		out.push_back((unsigned char)(literal - 1));
+		for (size_t i = 0; i < literal; i++)
+		{
+			AppendPixel(out, p[x + i], bytes);
+		}
+		x += literal;
+	}
+}
+
+// Build a TGA file. With crossRows, RLE packets are allowed to continue on
+// the next row, as some writers do.
+static vector<unsigned char> MakeTga(const Image& image, unsigned int bpp, bool rle, bool topDown, bool crossRows, unsigned int idLength)
+{
+	vector<unsigned char> data(18 + idLength, 0);
+	data[0]  = (unsigned char)idLength;
+	data[2]  = rle ? 10 : 2;
+	data[12] = (unsigned char)image.width;
+	data[13] = (unsigned char)(image.width >> 8);
+	data[14] = (unsigned char)image.height;
+	data[15] = (unsigned char)(image.height >> 8);
+	data[16] = (unsigned char)bpp;
+	data[17] = (unsigned char)((bpp == 32 ? 0x08 : 0) | (topDown ? 0x20 : 0));
+
+	// The rows in file order
+	vector<uint32_t> pixels;
+	for (unsigned long r = 0; r < image.height; r++)
+	{
+		unsigned long y = topDown ? image.height - r - 1 : r;
+		pixels.insert(pixels.end(), image.pixels.begin() + y * image.width, image.pixels.begin() + (y + 1) * image.width);
+	}
+
+	unsigned int bytes = bpp / 8;
+	if (!rle)
+	{
+		for (size_t i = 0; i < pixels.size(); i++)
+		{
+			AppendPixel(data, pixels[i], bytes);
+		}
+	}
+	else if (crossRows)
+	{
+		EncodeReference(&pixels[0], pixels.size(), bytes, data);
+	}
+	else
+	{
+		for (unsigned long r = 0; r < image.height; r++)
+		{
+			EncodeReference(&pixels[r * image.width], image.width, bytes, data);
+		}
+	}
+	return data;
+}
+
+static vector<unsigned char> ReadTempFile()
+{
+	vector<unsigned char> data;
+	FILE* file = fopen("test_tga.tmp", "rb");
+	if (file != NULL)
+	{
+		unsigned char buffer[4096];
+		size_t n;
+		while ((n = fread(buffer, 1, sizeof buffer, file)) > 0)
+		{
+			data.insert(data.end(), buffer, buffer + n);
+		}
+		fclose(file);
+	}
+	return data;
+}
+
+// Decode into a buffer with room to spare on every row, and compare
+static bool DecodeMatches(const vector<unsigned char>& data, const Image& image)
+{
+	TgaHeader header;
+	if (!ReadTgaHeader(&data[0], data.size(), header) || header.width != image.width || header.height != image.height)
+	{
+		return false;
+	}
+
+	size_t pitch = image.width * 4 + 12;
+	vector<unsigned char> bits(pitch * image.height, 0xCD);
+	if (!DecodeTga(&data[0], data.size(), header, &bits[0], pitch))
+	{
+		return false;
+	}
+	for (unsigned long y = 0; y < image.height; y++)
+	{
+		if (memcmp(&bits[y * pitch], &image.pixels[y * image.width], image.width * 4) != 0)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Decode with the border, and check the border as well
+static bool BorderDecodeMatches(const vector<unsigned char>& data, const Image& image)
+{
+	TgaHeader header;
+	if (!ReadTgaHeader(&data[0], data.size(), header))
+	{
+		return false;
+	}
+
+	unsigned long w = image.width, h = image.height;
+	vector<uint32_t> bits((w + 2) * (h + 2), 0xCDCDCDCD);
+	if (!DecodeTga(&data[0], data.size(), header, (unsigned char*)&bits[w + 3], (w + 2) * 4, true))
+	{
+		return false;
+	}
+	for (long y = -1; y <= (long)h; y++)
+	{
+		for (long x = -1; x <= (long)w; x++)
+		{
+			unsigned long sx = (unsigned long)min(max(x, 0L), (long)w - 1);
+			unsigned long sy = (unsigned long)min(max(y, 0L), (long)h - 1);
+			if (bits[(y + 1) * (w + 2) + (x + 1)] != image.at(sx, sy))
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static void TestWrite(Random& random)
+{
+	static const unsigned long Sizes[][2] = { {1, 1}, {2, 1}, {5, 3}, {17, 5}, {128, 2}, {130, 4}, {300, 3}, {64, 64} };
+	for (size_t s = 0; s < sizeof Sizes / sizeof Sizes[0]; s++)
+	{
+		for (int rle = 0; rle < 2; rle++)
+		{
+			for (int padded = 0; padded < 2; padded++)
+			{
+				Image image = MakeImage(random, Sizes[s][0], Sizes[s][1], false);
+
+				size_t pitch = image.width * 4 + (padded ? 20 : 0);
+				vector<unsigned char> bits(pitch * image.height);
+				for (unsigned long y = 0; y < image.height; y++)
+				{
+					memcpy(&bits[y * pitch], &image.pixels[y * image.width], image.width * 4);
+				}
+
+				OutputFile file;
+				CHECK(file.create(TEMP_FILE));
+				CHECK(WriteTga(file, &bits[0], pitch, image.width, image.height, rle != 0));
+				file.close();
+
+				vector<unsigned char> written = ReadTempFile();
+				CHECK(written == MakeTga(image, 32, rle != 0, false, false, 0));
+				CHECK(DecodeMatches(written, image));
+			}
+		}
+	}
+	RemoveFile(TEMP_FILE);
+}
+
+static void TestDecode(Random& random)
+{
+	for (unsigned int bpp = 24; bpp <= 32; bpp += 8)
+	{
+		for (int kind = 0; kind < 3; kind++)		// Uncompressed, RLE, RLE across rows
+		{
+			for (int topDown = 0; topDown < 2; topDown++)
+			{
+				Image image = MakeImage(random, 1 + random.below(200), 1 + random.below(40), bpp == 24);
+				vector<unsigned char> data = MakeTga(image, bpp, kind != 0, topDown != 0, kind == 2, (unsigned int)random.below(4));
+
+				CHECK(DecodeMatches(data, image));
+				CHECK(BorderDecodeMatches(data, image));
+
+				// Every byte of the pixel data is needed
+				TgaHeader header;
+				vector<uint32_t> bits(image.width * image.height);
+				CHECK(ReadTgaHeader(&data[0], data.size(), header));
+				CHECK(!DecodeTga(&data[0], data.size() - 1, header, (unsigned char*)&bits[0], image.width * 4));
+			}
+		}
+	}
+
+	// Not something this codec reads
+	Image image = MakeImage(random, 4, 4, false);
+	vector<unsigned char> data = MakeTga(image, 32, false, false, false, 0);
+	TgaHeader header;
+	data[2] = 3;
+	CHECK(!ReadTgaHeader(&data[0], data.size(), header));
+	data[2] = 2;
+	data[16] = 16;
+	CHECK(!ReadTgaHeader(&data[0], data.size(), header));
+	CHECK(!ReadTgaHeader(&data[0], 17, header));
+}
+
+static void TestRegions(Random& random)
+{
+	for (int kind = 0; kind < 3; kind++)
+	{
+		for (int topDown = 0; topDown < 2; topDown++)
+		{
+			Image image = MakeImage(random, 50 + random.below(300), 20 + random.below(60), false);
+			vector<unsigned char> data = MakeTga(image, 32, kind != 0, topDown != 0, kind == 2, 0);
+
+			TgaHeader header;
+			CHECK(ReadTgaHeader(&data[0], data.size(), header));
+
+			vector<TgaRowStart> rows;
+			if (header.rle)
+			{
+				CHECK(IndexTgaRows(&data[0], data.size(), header, rows));
+				CHECK(rows.size() == image.height);
+				vector<TgaRowStart> truncated;
+				CHECK(!IndexTgaRows(&data[0], data.size() - 1, header, truncated));
+			}
+
+			for (int i = 0; i < 50; i++)
+			{
+				// (x,y) is measured from the top
+				unsigned long x = random.below(image.width), y = random.below(image.height);
+				unsigned long w = 1 + random.below(image.width - x), h = 1 + random.below(image.height - y);
+
+				vector<uint32_t> bits(w * h);
+				bool decoded = DecodeTgaRegion(&data[0], data.size(), header, header.rle ? &rows : NULL, x, y, w, h, (unsigned char*)&bits[0], w * 4);
+				CHECK(decoded);
+
+				bool same = true;
+				for (unsigned long r = 0; r < h; r++)
+				{
+					// Row r of bits, from the bottom, is this row of the image
+					unsigned long row = image.height - y - h + r;
+					same = same && memcmp(&bits[r * w], &image.pixels[row * image.width + x], w * 4) == 0;
+				}
+				CHECK(same);
+			}
+		}
+	}
+}
+
+int main()
+{
+	Random random(2024);
+	TestWrite(random);
+	TestDecode(random);
+	TestRegions(random);
+	return TestResult();
+}
\ No newline at end of file
@@ -0,0 +1,56 @@
+//
+// This file contains what the tests share: CHECK, which reports a failed
+// condition and lets the test go on, and a small random generator that
+// gives every run the same cases.
+//
+#ifndef TESTUTIL_H
+#define TESTUTIL_H
+
+#include <stdio.h>
+#include "types.h"
+
+static int Failures = 0;
+
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) \
+		{ \
+			if (Failures++ < 20) fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+		} \
+	} while (0)
+
+// What main returns
+static inline int TestResult()
+{
+	if (Failures > 0)
+	{
+		fprintf(stderr, "%d checks failed\n", Failures);
+		return 1;
+	}
+	return 0;
+}
+
+// Xorshift; good enough to pick test cases
+class Random
+{
+	uint32_t state;
+
+public:
+	uint32_t next()
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+	}
+
+	// A number in [0, n)
+	unsigned long below(unsigned long n)
+	{
+		return next() % n;
+	}
+
+	explicit Random(uint32_t seed) : state(seed ? seed : 1) {}
+};
+
+#endif
\ No newline at end of file